@@ -1,16 +1,53 @@
 #pragma once
 #include "Math.h"
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <vector>
 #include <string>
 
-//{ vertex1{ posID, texCoordID, normalID}, vertex2{}, vertex3{} }
-using Ind = std::vector<std::vector<int>>;
+class Texture;
+
+//model space axis aligned box and bounding sphere
+struct Bounds {
+	Math::vec3 min;
+	Math::vec3 max;
+	Math::vec3 center;
+	float radius = 0;
+};
+
+//meshlet of spatially close triangles MeshLod::clusterIndex[first, first + count), culled as a whole before vertex processing
+//every cluster owns its vertices, so clusters are transformed independently
+struct Cluster {
+	Bounds bounds;
+	int first, count;
+	int vertexFirst, vertexCount;		//range in MeshLod::clusterVertex
+
+	//every face normal n has dot(n, coneAxis) >= sqrt(1 - coneCutoff^2), coneCutoff = 1 disables cone culling
+	Math::vec3 coneAxis;
+	float coneCutoff = 1.f;
+};
+
+//one level of detail split into meshlets, coarser levels reuse the positions and normals of the full mesh
+struct MeshLod {
+	float error = 0;											//model space distance to the full mesh
+	std::vector<Cluster> cluster;
+	std::vector<std::array<int, 3>> clusterVertex;				//{ posID, texCoordID, normalID }
+	std::vector<float> vertexPos[3], vertexNormal[3], vertexUV[2];		//clusterVertex split into components, 8 more at the end for 8 wide reads
+	std::vector<std::array<int, 3>> clusterIndex;				//clusterVertex ids of every triangle
+};
 
 struct Mesh {
-	std::vector<Ind> tInfo;
+	std::vector<std::array<int, 3>> vertex;						//{ posID, texCoordID, normalID } of every distinct corner of the obj
+	std::vector<uint32_t> index;								//3 vertices per triangle
 	std::vector<Math::vec3> mPos;
 	std::vector<Math::vec2> texCoord;							//texture uv
 	std::vector<Math::vec3> mNormal;
+	std::vector<Math::vec4> mTangent;							//per normal, along growing u, w = -1 where the uv are mirrored, only if asked for
+	std::shared_ptr<Texture> diffuseMap;						//map_Kd of the obj's material library, if any
+
+	Bounds bounds;
+	std::vector<MeshLod> lod;									//lod[0] is the full mesh, each next level about half the triangles
 };
 
 struct Vertex {
@@ -20,29 +57,21 @@ struct Vertex {
 		Math::vec4 sPos;		//screen space pos
 	};
 	Math::vec3 wNormal;			//world space normal
-
-	Vertex(const Vertex& x) :
-		wPos(x.wPos),
-		cPos(x.cPos), 
-		wNormal(x.wNormal) {}
+	Math::vec2 uv;				//texture coordinate
 
 	Vertex(const Math::vec3& wPos, 
 		const Math::vec4& cPos, 
-		const Math::vec3& wNormal) :
+		const Math::vec3& wNormal,
+		const Math::vec2& uv) :
 		wPos(wPos), 
 		cPos(cPos), 
-		wNormal(wNormal) {}
+		wNormal(wNormal),
+		uv(uv) {}
 
 	Vertex() :wPos(Math::vec3{}), 
 		cPos(Math::vec4{}), 
-		wNormal(Math::vec3{}) {}
-
-	Vertex operator = (const Vertex& x) {
-		wPos = x.wPos;
-		cPos = x.cPos;
-		wNormal = x.wNormal;
-		return { *this };
-	}
+		wNormal(Math::vec3{}),
+		uv(Math::vec2{}) {}
 };
 
 struct Triangle {
@@ -52,18 +81,25 @@ struct Triangle {
 struct Light {
 	Math::vec3 wPos;
 	Math::vec3 intensity;
-};
+	float radius = 0;			//fades out to nothing at this distance, 0 reaches everywhere
 
-struct Fragment {
-	int pid;
-	float depth;
-	Math::vec3 wPos;
-	Math::vec3 wNormal;
+	bool operator==(const Light&) const = default;
 };
 
 struct Matirial {
 	Math::vec3 ka;
 	Math::vec3 kd;
 	Math::vec3 ks;
+	std::shared_ptr<const Texture> diffuseMap;		//scales kd, none leaves kd as it is
+};
+
+struct Fragment {
+	int pid;
+	float depth;
+	Math::vec3 wPos;
+	Math::vec3 wNormal;
+	const Matirial* mtl;
+	Math::vec2 uv;
+	float lod;				//mip level of mtl->diffuseMap
 };
 
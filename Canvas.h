@@ -1,52 +1,43 @@
 #pragma once
 #include "Math.h"
-#include <windows.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
 #include <string>
+#include <vector>
 
+//platform neutral render target, backends provide the storage behind colorBuf
 class Canvas {
 	friend class Renderer;
-	//win32 draw
-	HDC memDC = nullptr;
-	HDC DC = nullptr;
-	HBITMAP bitMap = nullptr;
-	HGDIOBJ pen = nullptr;
-
+protected:
 	int width, height;
 	Math::vec3 bgColor;
 	Math::vec3 textColor;
 
-	unsigned int* colorBuf;
+	unsigned int* colorBuf = nullptr;		//0x00bbggrr, rows from bottom to top
 
 public:
 
-	Canvas(int w, int h, HWND hWnd, Math::vec3 bgColor, Math::vec3 textColor) : 
-		width(w), height(h), bgColor(bgColor), textColor(textColor)
-	{
-		DC = GetDC(hWnd);
-		memDC = CreateCompatibleDC(DC);
-		pen = CreatePen(PS_SOLID, 1, 0);
-		pen = SelectObject(DC, pen);
-		SetBkColor(memDC, RGB(255 * bgColor[0], 255 * bgColor[1], 255 * bgColor[2]));
-		SetTextColor(memDC, RGB(255 * textColor[0], 255 * textColor[1], 255 * textColor[2]));
-
-		BITMAPINFO bi = { { sizeof(BITMAPINFOHEADER), w, h, 1, 32, BI_RGB,
-			(DWORD)w * h * 4, 0, 0, 0, 0 } };
-		bitMap = CreateDIBSection(memDC, &bi, DIB_RGB_COLORS, (void**)&colorBuf, 0, 0);
-
-		if (bitMap)SelectObject(memDC, bitMap);
-		else throw EXCEPTION_BREAKPOINT;
-	}
+	Canvas(int w, int h, Math::vec3 bgColor, Math::vec3 textColor) :
+		width(w), height(h), bgColor(bgColor), textColor(textColor) {}
+
+	virtual ~Canvas() = default;
+
+	Canvas(const Canvas&) = delete;
+	Canvas& operator = (const Canvas&) = delete;
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	const unsigned int* data() const { return colorBuf; }
 
-	~Canvas() {
-		DeleteDC(memDC);
-		DeleteObject(bitMap);
-		pen = SelectObject(DC, pen);
-		DeleteObject(pen);
-		DeleteDC(DC);
+	static unsigned int packColor(const Math::vec3& color) {
+		return (unsigned int)(unsigned char)(int)(255 * color[0]) |
+			(unsigned int)(unsigned char)(int)(255 * color[1]) << 8 |
+			(unsigned int)(unsigned char)(int)(255 * color[2]) << 16;
 	}
 
 	void drawPixel(int pid, const Math::vec3& color) {
-		colorBuf[pid] = RGB(255 * color[0], 255 * color[1], 255 * color[2]);
+		colorBuf[pid] = packColor(color);
 	}
 
 	bool Cohen_Sutherland(float& x0, float& y0, float& x1, float& y1) const {
@@ -109,11 +100,11 @@ public:
 	}
 
 	void Bresenham(int x0, int y0, int x1, int y1) {
-		x0 = min(max(0, x0), width - 1);
-		x1 = min(max(0, x1), width - 1);
-		y0 = min(max(0, y0), height - 1);
-		y1 = min(max(0, y1), height - 1);
-		bool steep = abs(y1 - y0) > abs(x1 - x0);
+		x0 = std::min(std::max(0, x0), width - 1);
+		x1 = std::min(std::max(0, x1), width - 1);
+		y0 = std::min(std::max(0, y0), height - 1);
+		y1 = std::min(std::max(0, y1), height - 1);
+		bool steep = std::abs(y1 - y0) > std::abs(x1 - x0);
 		if (steep) {
 			std::swap(x0, y0);
 			std::swap(x1, y1);
@@ -122,7 +113,7 @@ public:
 			std::swap(x0, x1);
 			std::swap(y0, y1);
 		}
-		int dx = x1 - x0, dy = abs(y1 - y0);
+		int dx = x1 - x0, dy = std::abs(y1 - y0);
 		int error = dx / 2.f;
 		int ystep = y0 < y1 ? 1 : -1;
 		int y = y0;
@@ -137,21 +128,61 @@ public:
 		}
 	}
 
+	//binary PPM (P6), top row first
+	bool savePPM(const std::string& file) const {
+		std::ofstream ofs(file, std::ios::binary);
+		if (!ofs.is_open())return false;
+
+		ofs << "P6\n" << width << " " << height << "\n255\n";
+		std::vector<unsigned char> row(3 * width);
+		for (int y = height - 1; y >= 0; y--) {
+			for (int x = 0; x < width; x++) {
+				unsigned int c = colorBuf[y * width + x];
+				row[3 * x] = c & 0xff;
+				row[3 * x + 1] = c >> 8 & 0xff;
+				row[3 * x + 2] = c >> 16 & 0xff;
+			}
+			ofs.write((const char*)row.data(), row.size());
+		}
+		return ofs.good();
+	}
+
+	//headerless 8 bit RGBA, top row first
+	bool saveRaw(const std::string& file) const {
+		std::ofstream ofs(file, std::ios::binary);
+		if (!ofs.is_open())return false;
+
+		std::vector<unsigned char> row(4 * width);
+		for (int y = height - 1; y >= 0; y--) {
+			for (int x = 0; x < width; x++) {
+				unsigned int c = colorBuf[y * width + x];
+				row[4 * x] = c & 0xff;
+				row[4 * x + 1] = c >> 8 & 0xff;
+				row[4 * x + 2] = c >> 16 & 0xff;
+				row[4 * x + 3] = 0xff;
+			}
+			ofs.write((const char*)row.data(), row.size());
+		}
+		return ofs.good();
+	}
+
 	std::wstring debugInfo() {
 		return L"\nresolution:" + std::to_wstring(width) + L"x" + std::to_wstring(height);
 	}
 
-	void drawDebugInfo(const std::wstring& str) {
-		RECT rect;
-		rect.left = 16;
-		rect.top = 0;
-		rect.right = 400;
-		rect.bottom = 500;
+	virtual void drawDebugInfo(const std::wstring& str) {}
 
-		DrawTextW(memDC, str.c_str(), str.length(), &rect, DT_LEFT | DT_TOP);
-	}
+	virtual void update() {}
+};
+
+//in-memory canvas for rendering without a window
+class OffscreenCanvas :public Canvas {
+	std::vector<unsigned int> storage;
+
+public:
 
-	void update() const {
-		BitBlt(DC, 0, 0, width, height, memDC, 0, 0, SRCCOPY);
+	OffscreenCanvas(int w, int h, Math::vec3 bgColor, Math::vec3 textColor = {}) :
+		Canvas(w, h, bgColor, textColor), storage((size_t)w * h) {
+		colorBuf = storage.data();
 	}
-};
\ No newline at end of file
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+#include <utility>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//a whole file mapped read only, the pages are read in by the os as they are touched
+class MappedFile {
+	const char* ptr = nullptr;
+	size_t length = 0;
+
+	void close() {
+		if (ptr) {
+#ifdef _WIN32
+			UnmapViewOfFile(ptr);
+#else
+			munmap(const_cast<char*>(ptr), length);
+#endif
+		}
+		ptr = nullptr;
+		length = 0;
+	}
+
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& x) noexcept :ptr(std::exchange(x.ptr, nullptr)), length(std::exchange(x.length, 0)) {}
+	MappedFile& operator=(MappedFile&& x) noexcept {
+		if (this != &x) {
+			close();
+			ptr = std::exchange(x.ptr, nullptr);
+			length = std::exchange(x.length, 0);
+		}
+		return *this;
+	}
+	~MappedFile() { close(); }
+
+	//an empty file opens fine but maps nothing
+	bool open(const std::filesystem::path& file) {
+		close();
+#ifdef _WIN32
+		HANDLE handle = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (handle == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER fileSize;
+		bool ok = GetFileSizeEx(handle, &fileSize);
+		if (ok && fileSize.QuadPart > 0) {
+			HANDLE mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			ptr = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if (mapping) CloseHandle(mapping);
+			ok = ptr != nullptr;
+			length = ok ? (size_t)fileSize.QuadPart : 0;
+		}
+		CloseHandle(handle);
+		return ok;
+#else
+		int fd = ::open(file.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0;
+		if (ok && st.st_size > 0) {
+			void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			ok = p != MAP_FAILED;
+			if (ok) {
+				ptr = (const char*)p;
+				length = st.st_size;
+				madvise(p, length, MADV_SEQUENTIAL);
+			}
+		}
+		::close(fd);
+		return ok;
+#endif
+	}
+
+	const char* data() const { return ptr; }
+	size_t size() const { return length; }
+};
@@ -1,28 +1,45 @@
 ﻿#pragma once
 #include <initializer_list>
 #include <algorithm>
+#include <cmath>
 #include <concepts>
+#include <limits>
+#include <type_traits>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define MATH_SSE
+#endif
 
 namespace Math {
 	inline const float eps = 1e-6f;
 	inline const float pi = 3.1415926f;
 
-	inline static float Q_rsqrt(float number) {   
-		long i;
-		float x2, y;
-		const float threehalfs = 1.5F;
-
-		x2 = number * 0.5F;
-		y = number;
-		i = *(long*)&y;
-		i = 0x5f3759df - (i >> 1);
-		y = *(float*)&i;
-		y = y * (threehalfs - (x2 * y * y));
-
-		return y;
+	//1 / sqrt(x), the hardware estimate (12 bits) refined by one newton step to nearly full float precision
+#ifdef MATH_SSE
+	inline __m128 rsqrt(__m128 x) {
+		__m128 y = _mm_rsqrt_ps(x);
+		__m128 xyy = _mm_mul_ps(_mm_mul_ps(x, y), y);
+		return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), y), _mm_sub_ps(_mm_set1_ps(3.f), xyy));
+	}
+#endif
+#if defined(__AVX__)
+	inline __m256 rsqrt(__m256 x) {
+		__m256 y = _mm256_rsqrt_ps(x);
+		__m256 xyy = _mm256_mul_ps(_mm256_mul_ps(x, y), y);
+		return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), y), _mm256_sub_ps(_mm256_set1_ps(3.f), xyy));
+	}
+#endif
+	inline float rsqrt(float x) {
+#ifdef MATH_SSE
+		return _mm_cvtss_f32(rsqrt(_mm_set_ss(x)));
+#else
+		return 1.f / std::sqrt(x);
+#endif
 	}
 
 
+	//plain arrays, trivially copyable so they live in registers and copy with memcpy;
+	//vec4 and mat4 of float take 4-wide SSE paths outside of constant evaluation
 	template<int len, class Tx>
 	requires requires (Tx a, Tx b){
 		requires len > 0 && len <= 4;
@@ -32,33 +49,27 @@ namespace Math {
 		a / b;
 	}
 	class vec {
-		Tx v[len];
-	public:
-		vec<len, Tx>() {
-			for (int i = 0; i < len; i++)
-				v[i] = 0;
-		}
-		vec<len, Tx>(const vec<len, Tx>& x) {
-			for (int i = 0; i < len; i++)
-				v[i] = x.v[i];
+		static constexpr bool simd = len == 4 && std::is_same_v<Tx, float>;
+
+		alignas(simd ? 16 : alignof(Tx)) Tx v[len];
+
+#ifdef MATH_SSE
+		__m128 load() const { return _mm_load_ps(v); }
+		static vec<len, Tx> store(__m128 x) {
+			vec<len, Tx> ret;
+			_mm_store_ps(ret.v, x);
+			return ret;
 		}
-		vec<len, Tx>(const std::initializer_list<Tx>& x) {
+#endif
+	public:
+		constexpr vec() :v{} {}
+		constexpr vec(const std::initializer_list<Tx>& x) :v{} {
 			auto it = x.begin();
-			for (int i = 0; i < len; i++) {
-				if (it != x.end()) {
-					v[i] = *it;
-					it++;
-				}
-				else v[i] = 0;
-			}
+			for (int i = 0; i < len && it != x.end(); i++, it++)
+				v[i] = *it;
 		}
 
-		vec<len, Tx> operator = (const vec<len, Tx>& x) {
-			for (int i = 0; i < len; i++)
-				v[i] = x[i];
-			return { *this };
-		}
-		vec<len, Tx> operator = (const std::initializer_list<float>& x) {
+		constexpr vec<len, Tx>& operator = (const std::initializer_list<float>& x) {
 			auto it = x.begin();
 			for (int i = 0; i < len; i++) {
 				if (it != x.end()) {
@@ -67,61 +78,84 @@ namespace Math {
 				}
 				else v[i] = 0;
 			}
-			return { *this };
+			return *this;
 		}
 
-		Tx& operator[] (int x) { return v[x]; }
-		const Tx& operator[] (int x) const { return v[x]; }
+		constexpr Tx& operator[] (int x) { return v[x]; }
+		constexpr const Tx& operator[] (int x) const { return v[x]; }
 
-		vec<len, Tx> operator +(const vec<len, Tx>& u) const {
+		constexpr bool operator ==(const vec<len, Tx>& u) const {
+			for (int i = 0; i < len; i++)
+				if (v[i] != u.v[i]) return false;
+			return true;
+		}
+
+		constexpr vec<len, Tx> operator +(const vec<len, Tx>& u) const {
+#ifdef MATH_SSE
+			if constexpr (simd) if (!std::is_constant_evaluated()) return store(_mm_add_ps(load(), u.load()));
+#endif
 			vec<len, Tx> ret;
 			for (int i = 0; i < len; i++)ret[i] = v[i] + u[i];
 			return ret;
 		}
-		vec<len, Tx> operator -(const vec<len, Tx>& u) const {
+		constexpr vec<len, Tx> operator -(const vec<len, Tx>& u) const {
+#ifdef MATH_SSE
+			if constexpr (simd) if (!std::is_constant_evaluated()) return store(_mm_sub_ps(load(), u.load()));
+#endif
 			vec<len, Tx> ret;
 			for (int i = 0; i < len; i++)ret[i] = v[i] - u[i];
 			return ret;
 		}
-		vec<len, Tx> operator -() const {
+		constexpr vec<len, Tx> operator -() const {
+#ifdef MATH_SSE
+			if constexpr (simd) if (!std::is_constant_evaluated()) return store(_mm_xor_ps(load(), _mm_set1_ps(-0.f)));
+#endif
 			vec<len, Tx> ret;
 			for (int i = 0; i < len; i++)ret[i] = -v[i];
 			return ret;
 		}
-		vec<len, Tx> operator *(Tx k) const {
+		constexpr vec<len, Tx> operator *(Tx k) const {
+#ifdef MATH_SSE
+			if constexpr (simd) if (!std::is_constant_evaluated()) return store(_mm_mul_ps(load(), _mm_set1_ps(k)));
+#endif
 			vec<len, Tx> ret;
 			for (int i = 0; i < len; i++)ret[i] = v[i] * k;
 			return ret;
 		}
-		vec<len, Tx> operator /(Tx k) const {
+		constexpr vec<len, Tx> operator /(Tx k) const {
+#ifdef MATH_SSE
+			if constexpr (simd) if (!std::is_constant_evaluated()) return store(_mm_div_ps(load(), _mm_set1_ps(k)));
+#endif
 			vec<len, Tx> ret;
 			for (int i = 0; i < len; i++)ret[i] = v[i] / k;
 			return ret;
 		}
-		vec<len, Tx> cwiseProduct(const vec<len, Tx>& u) const {
+		constexpr vec<len, Tx> cwiseProduct(const vec<len, Tx>& u) const {
+#ifdef MATH_SSE
+			if constexpr (simd) if (!std::is_constant_evaluated()) return store(_mm_mul_ps(load(), u.load()));
+#endif
 			vec<len, Tx> ret;
 			for (int i = 0; i < len; i++)ret[i] = v[i] * u[i];
 			return ret;
 		}
-		Tx dot(const vec<len, Tx>& u) const {
+		constexpr Tx dot(const vec<len, Tx>& u) const {
 			Tx ret = 0;
 			for (int i = 0; i < len; i++)ret += v[i] * u[i];
 			return ret;
 		}
-		vec<3, Tx> cross(const vec<3, Tx>& u) const {
+		constexpr vec<3, Tx> cross(const vec<3, Tx>& u) const {
 			return { v[1] * u[2] - v[2] * u[1], v[2] * u[0] - v[0] * u[2], v[0] * u[1] - v[1] * u[0] };
 		}
 
+		//the zero vector (and anything too short for a normal float length) stays zero
 		vec<len, Tx> normalized() const {
-			vec<len, Tx> ret;
 			float t = 0;
 			for (int i = 0; i < len; i++)
-				t += v[i] * v[i], ret.v[i] = v[i];
-			t = Math::Q_rsqrt(t);
-			for (int i = 0; i < len; i++) ret.v[i] *= t;
-			return ret;
+				t += v[i] * v[i];
+			t = t >= std::numeric_limits<float>::min() ? Math::rsqrt(t) : 0.f;
+			return *this * t;
 		}
-		vec<len, Tx> clamped(Tx sl, Tx sr, Tx tl, Tx tr) const {
+		constexpr vec<len, Tx> clamped(Tx sl, Tx sr, Tx tl, Tx tr) const {
 			vec<len, Tx> ret;
 			for (int i = 0; i < len; i++) {
 				if (v[i] > sr)ret.v[i] = tr;
@@ -132,6 +166,7 @@ namespace Math {
 		}
 	};
 
+	//row major, m[i] is row i
 	template<int size, class Tx>
 		requires requires (Tx a, Tx b) {
 		requires size > 0 && size <= 4;
@@ -141,66 +176,50 @@ namespace Math {
 		a / b;
 	}
 	class mat {
-		Tx m[size][size];
+		static constexpr bool simd = size == 4 && std::is_same_v<Tx, float>;
+
+		alignas(simd ? 16 : alignof(Tx)) Tx m[size][size];
 	public:
-		mat<size, Tx>() {
-			for (int i = 0; i < size; i++) {
-				for (int j = 0; j < size; j++) {
-					m[i][j] = 0;
-				}
-			}
-		}
-		mat<size, Tx>(const mat<size, Tx>& B) {
-			for (int i = 0; i < size; i++) {
-				for (int j = 0; j < size; j++) {
-					m[i][j] = B[i][j];
-				}
-			}
-		}
-		mat<size, Tx>(const std::initializer_list<float>& x) {
+		constexpr mat() :m{} {}
+		constexpr mat(const std::initializer_list<float>& x) :m{} {
 			auto it = x.begin();
-			for (int i = 0; i < size; i++) {
-				for (int j = 0; j < size; j++) {
-					if (it != x.end()) {
-						m[i][j] = *it;
-						it++;
-					}
-					else {
-						m[i][j] = 0;
-					}
-				}
-			}
+			for (int i = 0; i < size * size && it != x.end(); i++, it++)
+				m[i / size][i % size] = *it;
 		}
 
-		mat<size, Tx> operator = (const mat<size, Tx>& B) {
-			for (int i = 0; i < size; i++) {
-				for (int j = 0; j < size; j++) {
-					m[i][j] = B[i][j];
-				}
-			}
-			return { *this };
-		}
-		mat<size, Tx> operator = (const std::initializer_list<float> x) {
+		constexpr mat<size, Tx>& operator = (const std::initializer_list<float> x) {
 			auto it = x.begin();
 			for (int i = 0; i < size * size && it != x.end(); i++, it++)
-				m[i] = *it;
-			return { *this };
+				m[i / size][i % size] = *it;
+			return *this;
 		}
 
-		mat<size, Tx> identity() {
+		static constexpr mat<size, Tx> identity() {
 			mat<size, Tx> ret;
 			for (int i = 0; i < size; i++) {
-				for (int j = 0; j < size; j++) {
-					ret[i][j] = i == j;
-				}
+				ret[i][i] = 1;
 			}
 			return ret;
 		}
 
-		Tx* operator[] (int x) { return m[x]; }
-		const Tx* operator[] (int x) const { return m[x]; }
+		constexpr Tx* operator[] (int x) { return m[x]; }
+		constexpr const Tx* operator[] (int x) const { return m[x]; }
 
-		vec<size, Tx> operator *(const vec<size, Tx>& u) const {
+		constexpr vec<size, Tx> operator *(const vec<size, Tx>& u) const {
+#ifdef MATH_SSE
+			//columns times the components of u, the terms added in the same order as below
+			if constexpr (simd) if (!std::is_constant_evaluated()) {
+				__m128 c0 = _mm_load_ps(m[0]), c1 = _mm_load_ps(m[1]), c2 = _mm_load_ps(m[2]), c3 = _mm_load_ps(m[3]);
+				_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+				__m128 acc = _mm_mul_ps(c0, _mm_set1_ps(u[0]));
+				acc = _mm_add_ps(acc, _mm_mul_ps(c1, _mm_set1_ps(u[1])));
+				acc = _mm_add_ps(acc, _mm_mul_ps(c2, _mm_set1_ps(u[2])));
+				acc = _mm_add_ps(acc, _mm_mul_ps(c3, _mm_set1_ps(u[3])));
+				vec<size, Tx> ret;
+				_mm_store_ps(&ret[0], acc);
+				return ret;
+			}
+#endif
 			vec<size, Tx> ret;
 			for (int i = 0; i < size; i++) {
 				for (int j = 0; j < size; j++) {
@@ -209,7 +228,20 @@ namespace Math {
 			}
 			return ret;
 		}
-		mat<size, Tx> operator *(const mat<size, Tx>& B) const {
+		constexpr mat<size, Tx> operator *(const mat<size, Tx>& B) const {
+#ifdef MATH_SSE
+			//row i of the product is the rows of B weighted by row i of this
+			if constexpr (simd) if (!std::is_constant_evaluated()) {
+				__m128 b[4] = { _mm_load_ps(B[0]), _mm_load_ps(B[1]), _mm_load_ps(B[2]), _mm_load_ps(B[3]) };
+				mat<size, Tx> ret;
+				for (int i = 0; i < 4; i++) {
+					__m128 acc = _mm_mul_ps(_mm_set1_ps(m[i][0]), b[0]);
+					for (int k = 1; k < 4; k++) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(m[i][k]), b[k]));
+					_mm_store_ps(ret[i], acc);
+				}
+				return ret;
+			}
+#endif
 			mat<size, Tx> ret;
 			for (int i = 0; i < size; i++) {
 				for (int k = 0; k < size; k++) {
@@ -220,21 +252,21 @@ namespace Math {
 			}
 			return ret;
 		}
-		mat<size, Tx> inverse() {
+		constexpr mat<size, Tx> inverse() const {
 			mat<size, Tx> ret = identity();
 			mat<size, Tx> self(*this);
 			for (int i = 0; i < size - 1; i++) {
 				int pivot = i;
 				float pivotsize = self[i][i];
-				pivotsize = abs(pivotsize);
+				pivotsize = pivotsize < 0 ? -pivotsize : pivotsize;
 				for (int j = i + 1; j < size; j++) {
-					float tmp = abs(self[j][i]);
+					float tmp = self[j][i] < 0 ? -self[j][i] : self[j][i];
 					if (tmp > pivotsize) {
 						pivot = j;
 						pivotsize = tmp;
 					}
 				}
-				if (abs(pivotsize) < Math::eps) {
+				if (pivotsize < Math::eps) {
 					return mat<size, Tx>{};
 				}
 				if (pivot != i) {
@@ -269,11 +301,20 @@ namespace Math {
 			}
 			return ret;
 		}
-		mat<size, Tx> transpose() {
-			mat<size, Tx> ret = {};
+		constexpr mat<size, Tx> transpose() const {
+#ifdef MATH_SSE
+			if constexpr (simd) if (!std::is_constant_evaluated()) {
+				__m128 r0 = _mm_load_ps(m[0]), r1 = _mm_load_ps(m[1]), r2 = _mm_load_ps(m[2]), r3 = _mm_load_ps(m[3]);
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+				mat<size, Tx> ret;
+				_mm_store_ps(ret[0], r0), _mm_store_ps(ret[1], r1), _mm_store_ps(ret[2], r2), _mm_store_ps(ret[3], r3);
+				return ret;
+			}
+#endif
+			mat<size, Tx> ret;
 			for (int i = 0; i < size; i++) {
 				for (int j = 0; j < size; j++) {
-					ret[i][j] = (*this)[j][i];
+					ret[i][j] = m[j][i];
 				}
 			}
 			return ret;
@@ -281,10 +322,8 @@ namespace Math {
 	};
 
 	template<int len, class Tx>
-	vec<len, Tx> operator*(Tx k, const vec<len, Tx>& u) {
-		vec<len, Tx> ret;
-		for (int i = 0; i < len; i++)ret[i] = u[i] * k;
-		return ret;
+	constexpr vec<len, Tx> operator*(Tx k, const vec<len, Tx>& u) {
+		return u * k;
 	}
 
 	using vec2 = vec<2, float>;
@@ -292,4 +331,9 @@ namespace Math {
 	using vec3 = vec<3, float>;
 	using vec4 = vec<4, float>;
 	using mat4 = mat<4, float>;
-};
\ No newline at end of file
+
+	static_assert(std::is_trivially_copyable_v<vec3> && std::is_trivially_copyable_v<vec4> && std::is_trivially_copyable_v<mat4>);
+	static_assert(mat4::identity() * vec4{ 1, 2, 3, 4 } == vec4{ 1, 2, 3, 4 });
+};
+
+#undef MATH_SSE
@@ -0,0 +1,194 @@
+#pragma once
+#include "Base.h"
+#include "MappedFile.h"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+//a loaded obj with everything derived from it (generated normals, bounds, meshlets, the lod chain) as flat arrays
+//in one file, read back by copying every array straight out of a mapping, no parsing and no rebuilding;
+//the source obj's size and write time are kept, so a changed obj, another version or another struct layout is a miss
+class MeshCache {
+	static constexpr char magic[8] = { 'S', 'R', 'M', 'E', 'S', 'H', '\r', '\n' };
+	static constexpr uint32_t version = 2;
+	static constexpr uint32_t layout = sizeof(Cluster) << 16 | sizeof(Bounds) << 8 | sizeof(Math::vec4);
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t layout;
+		uint64_t sourceSize;
+		int64_t sourceTime;
+	};
+
+	static bool stamp(const std::filesystem::path& source, Header& h) {
+		std::error_code ec;
+		h.sourceSize = std::filesystem::file_size(source, ec);
+		if (ec) return false;
+		h.sourceTime = std::filesystem::last_write_time(source, ec).time_since_epoch().count();
+		return !ec;
+	}
+
+	class Writer {
+		std::ofstream& ofs;
+	public:
+		Writer(std::ofstream& ofs) :ofs(ofs) {}
+
+		template<class T>
+		void put(const T& x) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			ofs.write((const char*)&x, sizeof(T));
+		}
+		template<class T>
+		void put(const std::vector<T>& x) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			put((uint64_t)x.size());
+			ofs.write((const char*)x.data(), x.size() * sizeof(T));
+		}
+		void put(const std::string& x) {
+			put(std::vector<char>(x.begin(), x.end()));
+		}
+	};
+
+	class Reader {
+		const char* p;
+		const char* end;
+	public:
+		Reader(const char* p, const char* end) :p(p), end(end) {}
+
+		template<class T>
+		bool get(T& x) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			if ((size_t)(end - p) < sizeof(T)) return false;
+			std::memcpy(&x, p, sizeof(T));
+			p += sizeof(T);
+			return true;
+		}
+		template<class T>
+		bool get(std::vector<T>& x) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			uint64_t n;
+			if (!get(n) || n > (size_t)(end - p) / sizeof(T)) return false;
+			x.resize(n);
+			if (n) std::memcpy(x.data(), p, n * sizeof(T));
+			p += n * sizeof(T);
+			return true;
+		}
+		bool get(std::string& x) {
+			std::vector<char> v;
+			if (!get(v)) return false;
+			x.assign(v.begin(), v.end());
+			return true;
+		}
+		bool done() const { return p == end; }
+	};
+
+	//every id inside the pool it points into, so a damaged file that still has the right lengths is a miss too
+	static bool valid(const Mesh& mesh) {
+		auto inPools = [&](const std::array<int, 3>& v) {		//{ posID, texCoordID, normalID }
+			return (unsigned)v[0] < mesh.mPos.size() && (unsigned)v[2] < mesh.mNormal.size()
+				&& (mesh.texCoord.empty() || (unsigned)v[1] < mesh.texCoord.size());
+			};
+		if (!mesh.mTangent.empty() && mesh.mTangent.size() != mesh.mNormal.size()) return false;
+		for (auto& v : mesh.vertex) if (!inPools(v)) return false;
+		for (uint32_t i : mesh.index) if (i >= mesh.vertex.size()) return false;
+
+		for (auto& lod : mesh.lod) {
+			size_t numVertices = lod.clusterVertex.size();
+			for (auto& v : lod.clusterVertex) if (!inPools(v)) return false;
+			for (auto* a : { lod.vertexPos, lod.vertexNormal }) {
+				for (int k = 0; k < 3; k++) if (a[k].size() != numVertices + 8) return false;
+			}
+			for (auto& a : lod.vertexUV) if (a.size() != numVertices + 8) return false;
+
+			//clusterIndex holds ids into clusterVertex, each inside the range of the cluster owning the triangle
+			for (auto& c : lod.cluster) {
+				if (c.first < 0 || c.count < 0 || (size_t)c.first + c.count > lod.clusterIndex.size()) return false;
+				if (c.vertexFirst < 0 || c.vertexCount < 0 || (size_t)c.vertexFirst + c.vertexCount > numVertices) return false;
+				for (int id = c.first; id < c.first + c.count; id++) {
+					for (int v : lod.clusterIndex[id]) if (v < c.vertexFirst || v >= c.vertexFirst + c.vertexCount) return false;
+				}
+			}
+		}
+		return true;
+	}
+
+public:
+
+	//written to a temporary and renamed over the old cache, false if the directory is not writable
+	static bool save(const std::filesystem::path& file, const std::filesystem::path& source, const Mesh& mesh, bool generatedNormals, const std::string& mtllib) {
+		Header h{ {}, version, layout };
+		std::memcpy(h.magic, magic, sizeof(magic));
+		if (!stamp(source, h)) return false;
+
+		std::filesystem::path tmp = file;
+		tmp += ".tmp";
+		{
+			std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+			if (!ofs.is_open()) return false;
+			Writer w(ofs);
+			w.put(h);
+			w.put((uint8_t)generatedNormals);
+			w.put(mtllib);
+			w.put(mesh.mPos);
+			w.put(mesh.texCoord);
+			w.put(mesh.mNormal);
+			w.put(mesh.mTangent);
+			w.put(mesh.vertex);
+			w.put(mesh.index);
+			w.put(mesh.bounds);
+			w.put((uint64_t)mesh.lod.size());
+			for (auto& lod : mesh.lod) {
+				w.put(lod.error);
+				w.put(lod.cluster);
+				w.put(lod.clusterVertex);
+				for (auto& a : lod.vertexPos) w.put(a);
+				for (auto& a : lod.vertexNormal) w.put(a);
+				for (auto& a : lod.vertexUV) w.put(a);
+				w.put(lod.clusterIndex);
+			}
+			if (!ofs.flush()) {
+				ofs.close();
+				std::filesystem::remove(tmp);
+				return false;
+			}
+		}
+		std::error_code ec;
+		std::filesystem::rename(tmp, file, ec);
+		if (ec) std::filesystem::remove(tmp, ec);
+		return !ec;
+	}
+
+	//false leaves mesh partly filled, the caller starts over from the obj
+	static bool load(const std::filesystem::path& file, const std::filesystem::path& source, Mesh& mesh, bool& generatedNormals, std::string& mtllib) {
+		MappedFile map;
+		Header expected{ {}, version, layout }, h;
+		std::memcpy(expected.magic, magic, sizeof(magic));
+		if (!stamp(source, expected) || !map.open(file)) return false;
+
+		Reader r(map.data(), map.data() + map.size());
+		if (!r.get(h) || std::memcmp(h.magic, expected.magic, sizeof(magic)) || h.version != expected.version || h.layout != expected.layout
+			|| h.sourceSize != expected.sourceSize || h.sourceTime != expected.sourceTime) return false;
+
+		uint8_t generated;
+		uint64_t numLods;
+		if (!r.get(generated) || !r.get(mtllib) || !r.get(mesh.mPos) || !r.get(mesh.texCoord) || !r.get(mesh.mNormal) || !r.get(mesh.mTangent)
+			|| !r.get(mesh.vertex) || !r.get(mesh.index) || mesh.index.size() % 3 || !r.get(mesh.bounds) || !r.get(numLods) || numLods == 0 || numLods > 64) return false;
+		generatedNormals = generated;
+
+		mesh.lod.resize(numLods);
+		for (auto& lod : mesh.lod) {
+			bool ok = r.get(lod.error) && r.get(lod.cluster) && r.get(lod.clusterVertex);
+			for (auto& a : lod.vertexPos) ok = ok && r.get(a);
+			for (auto& a : lod.vertexNormal) ok = ok && r.get(a);
+			for (auto& a : lod.vertexUV) ok = ok && r.get(a);
+			if (!ok || !r.get(lod.clusterIndex)) return false;
+		}
+		return r.done() && valid(mesh);
+	}
+};
@@ -1,11 +1,26 @@
-#pragma once
+﻿#pragma once
 #include "Math.h"
 #include "Base.h"
+#include "Texture.h"
+#include "Thread.h"
+#include "MappedFile.h"
+#include "MeshCache.h"
 #include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <cmath>
+#include <cwchar>
+#include <filesystem>
 #include <fstream>
+#include <numeric>
+#include <queue>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <iostream>
+#include <memory>
+#include <unordered_map>
 
 enum Actions :int {
 	none = 0,
@@ -23,13 +38,21 @@ enum Actions :int {
 
 class Object {
 protected:
-	Math::vec3 wPos;	//λ
-	Math::vec3 g;		//
-	Math::vec3 up;		//Ϸ
+	Math::vec3 wPos;	//位置
+	Math::vec3 g;		//朝向
+	Math::vec3 up;		//向上方向
 
 	int state;
 	float speed;			
 	float rspeed;
+
+	//changes whenever the object moves, unique across objects, so copies share it only while they look the same
+	uint64_t version = newVersion();
+
+	static uint64_t newVersion() {
+		static std::atomic<uint64_t> counter = 0;
+		return ++counter;
+	}
 public:
 	Object(Math::vec3 wPos, Math::vec3 g, Math::vec3 up, int state, float speed, float rspeed) :
 		wPos(wPos), g(g), up(up), state(state), speed(speed), rspeed(rspeed){}
@@ -38,8 +61,11 @@ public:
 		wPos = wPos_;
 		g = g_;
 		up = up_;
+		version = newVersion();
 	}
 
+	uint64_t getVersion() const { return version; }
+
 	void setState(bool remove, int op) {
 		if (remove) state &= ~op;
 		else state |= op;
@@ -47,6 +73,7 @@ public:
 
 	void updateAtiitude() {
 		if (state == Actions::none) return;
+		version = newVersion();
 
 		auto Rodrigues = [](const Math::vec3& k, const Math::vec3& v, float theta)->Math::vec3 {
 			return (v * cosf(theta) + k.cross(v) * sinf(theta) + k * (k.dot(v) * (1.f - cosf(theta)))).normalized();
@@ -101,7 +128,7 @@ public:
     pos: %.2f %.2f %.2f
     face to: %.2f %.2f %.2f
     up: %.2f %.2f %.2f
-    state: %s
+    state: %ls
 )",
 wPos[0], wPos[1], wPos[2],
 g[0], g[1], g[2],
@@ -126,7 +153,7 @@ public:
 
 	Math::mat4 calcMatrixP() const {
 		float n = zNear, f = zFar;
-		float t = abs(n) * tanf(fov / 2.f);
+		float t = std::abs(n) * tanf(fov / 2.f);
 		float b = -t;
 		float r = t * aspect;
 		float l = -r;
@@ -185,152 +212,725 @@ class Model :public Object {
 	friend class Renderer;
 
 	std::wstring name;
-	Mesh mesh;
+	std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();		//shared by the instances of the model
 	Matirial mtl;
 
 	bool noNormal = false;
 	bool noUV = false;
 
-	std::vector<std::wstring> seprateLine(const std::wstring& str) {
-		std::vector<std::wstring> vec;
-		std::wstring tmp;
-		for (int i = 0; i < str.length(); i++) {
-			if (str[i] != L' ') {
-				tmp += str[i];
+	//what one line aligned piece of an obj holds, negative indices count back from the chunk's own vertices
+	//and get the vertices of the chunks before it added once those are known
+	struct ObjChunk {
+		std::vector<Math::vec3> pos, normal;
+		std::vector<Math::vec2> texCoord;
+		std::vector<std::array<int, 3>> corner;				//{ pos, tex, normal } of every triangle corner, 0 where not given
+		std::vector<std::pair<int, int>> relative;			//corner and component of the negative indices
+		std::string mtllib;
+	};
+
+	//n-gons are split into fans around their first corner, unknown statements are skipped
+	static void parseChunk(const char* p, const char* end, ObjChunk& out) {
+		auto blank = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+		auto skipBlank = [&]() { while (p < end && blank(*p)) p++; };
+		auto readFloats = [&](float* x, int n) {
+			for (int k = 0; k < n; k++) {
+				skipBlank();
+				if (p < end && *p == '+') p++;
+				x[k] = 0;
+				p = std::from_chars(p, end, x[k]).ptr;
+			}
+			};
+
+		std::vector<std::pair<std::array<int, 3>, int>> polygon;		//corner, mask of its negative components
+		while (p < end) {
+			skipBlank();
+			const char* key = p;
+			while (p < end && !blank(*p) && *p != '\n') p++;
+			std::string_view k(key, p - key);
+
+			if (k == "v") {
+				Math::vec3 v;
+				readFloats(&v[0], 3);
+				out.pos.push_back(v);
 			}
-			else {
-				vec.push_back(tmp);
-				tmp.clear();
+			else if (k == "vt") {
+				Math::vec2 v;
+				readFloats(&v[0], 2);
+				out.texCoord.push_back(v);
 			}
+			else if (k == "vn") {
+				Math::vec3 v;
+				readFloats(&v[0], 3);
+				out.normal.push_back(v);
+			}
+			else if (k == "f") {
+				int count[3] = { (int)out.pos.size(), (int)out.texCoord.size(), (int)out.normal.size() };
+				polygon.clear();
+				while (true) {
+					skipBlank();
+					if (p == end || *p == '\n' || *p == '#') break;
+					std::array<int, 3> c = { 0, 0, 0 };
+					int mask = 0;
+					for (int j = 0; j < 3; j++) {		//v, v/vt, v//vn or v/vt/vn
+						if (j > 0) {
+							if (p == end || *p != '/') break;
+							p++;
+						}
+						int i = 0;
+						auto [next, ec] = std::from_chars(p, end, i);
+						if (ec != std::errc{}) continue;
+						p = next;
+						if (i > 0) c[j] = i - 1;
+						else if (i < 0) c[j] = count[j] + i, mask |= 1 << j;
+					}
+					while (p < end && !blank(*p) && *p != '\n') p++;
+					polygon.push_back({ c, mask });
+				}
+				for (int i = 1; i + 1 < (int)polygon.size(); i++) {
+					for (int v : { 0, i, i + 1 }) {
+						for (int j = 0; j < 3; j++) {
+							if (polygon[v].second >> j & 1) out.relative.push_back({ (int)out.corner.size(), j });
+						}
+						out.corner.push_back(polygon[v].first);
+					}
+				}
+			}
+			else if (k == "mtllib" && out.mtllib.empty()) {
+				skipBlank();
+				const char* name = p;
+				while (p < end && *p != '\n') p++;
+				const char* last = p;
+				while (last > name && blank(last[-1])) last--;
+				out.mtllib.assign(name, last);
+			}
+			while (p < end && *p != '\n') p++;
+			p++;
 		}
-		if (!tmp.empty())vec.push_back(tmp);
-		return vec;
-	};
+	}
 
-	std::vector<int> seprate(const std::wstring& str) {
-		std::vector<int> vec(3, 0);
+	static std::filesystem::path utf8Path(const std::string& str) {
+		return std::filesystem::path(std::u8string(str.begin(), str.end()));
+	}
 
-		int p = str.find_first_of(L"/");
-		int q = str.find_last_of(L"/");
+	//numbers the distinct { posID, texCoordID, normalID } corners in order of first use, 3 vertex ids per triangle into index;
+	//the vertices of every position are chained, so a corner is only compared with the few others on its position
+	static void indexCorners(const std::vector<std::array<int, 3>>& corner, int numPos, std::vector<std::array<int, 3>>& vertex, std::vector<uint32_t>& index) {
+		std::vector<int> head(numPos, -1), next;
+		vertex.clear();
+		index.resize(corner.size());
+		for (size_t i = 0; i < corner.size(); i++) {
+			auto& c = corner[i];
+			int v = head[c[0]];
+			while (v >= 0 && vertex[v] != c) v = next[v];
+			if (v < 0) {
+				v = vertex.size();
+				vertex.push_back(c);
+				next.push_back(head[c[0]]);
+				head[c[0]] = v;
+			}
+			index[i] = v;
+		}
+	}
 
-		if (p < 0) {
-			vec[0] = std::stoi(str) - 1;
+	//the faces around every id are listed first, then every task owns a range of ids and walks only their faces,
+	//so no two tasks add to the same id and each id sums its faces in order, finish(st, ed) then runs on the range
+	template<class Add, class Finish>
+	static void gatherCorners(ThreadPool& threads, int numThreads, const std::vector<std::array<int, 3>>& corner, int count, const Add& add, const Finish& finish) {
+		int num = corner.size();
+		std::vector<int> faceFirst(count + 1, 0), face(3 * num);
+		for (auto& c : corner) {
+			for (int j = 0; j < 3; j++) faceFirst[c[j] + 1]++;
 		}
-		else {
-			vec[0] = std::stoi(str.substr(0, p)) - 1;
-			if (q - p - 1 > 0) vec[1] = std::stoi(str.substr(p + 1, q - p - 1)) - 1;
-			if (str.length() - q - 1 > 0) vec[2] = std::stoi(str.substr(q + 1, str.length() - q - 1)) - 1;
+		for (int v = 0; v < count; v++) faceFirst[v + 1] += faceFirst[v];
+		std::vector<int> cursor(faceFirst.begin(), faceFirst.end() - 1);
+		for (int id = 0; id < num; id++) {
+			for (int j = 0; j < 3; j++) face[cursor[corner[id][j]]++] = id;
 		}
 
-		return vec;
-	};
+		auto gatherTask = [&](int st, int ed) {
+			for (int v = st; v < ed; v++) {
+				for (int k = faceFirst[v]; k < faceFirst[v + 1]; k++) add(v, face[k]);
+			}
+			finish(st, ed);
+			};
 
-	void genNormals() { //Ȩɶ㷨
-		std::vector<std::vector<Math::vec3>> adjFacesNormal;
-		adjFacesNormal.resize(mesh.mPos.size());
+		int blockSize = std::max((count + numThreads - 1) / numThreads, 1);
+		for (int i = 0; i < count; i += blockSize) {
+			threads.addTask(gatherTask, i, std::min(i + blockSize, count));
+		}
+		threads.barrier();
+	}
 
-		for (auto& face : mesh.tInfo) {
-			Math::vec3 mPos[3];
-			for (int i = 0; i < 3; i++) {
-				mPos[i] = mesh.mPos[face[i][0]];
-				face[i][2] = face[i][0];
+	void genNormals(ThreadPool& threads, int numThreads) { //根据三角形面积加权生成顶点法线
+		auto& vertex = mesh->vertex;
+		auto& index = mesh->index;
+		int numFaces = index.size() / 3, numPos = mesh->mPos.size();
+
+		//1 the corners and cross product of every face into flat arrays, the cross product is twice the area long
+		std::vector<std::array<int, 3>> corner(numFaces);
+		std::vector<Math::vec3> faceNormal(numFaces);
+		auto faceTask = [&](int st, int ed) {
+			for (int id = st; id < ed; id++) {
+				for (int i = 0; i < 3; i++) corner[id][i] = vertex[index[3 * id + i]][0];
+				auto& p = mesh->mPos;
+				faceNormal[id] = (p[corner[id][0]] - p[corner[id][1]]).cross(p[corner[id][1]] - p[corner[id][2]]);
+			}
+			};
+		int blockSize = std::max(std::min(numFaces / (4 * numThreads), 8192), 1);
+		for (int i = 0; i < numFaces; i += blockSize) {
+			threads.addTask(faceTask, i, std::min(i + blockSize, numFaces));
+		}
+		threads.barrier();
+
+		//2 summed around every position, which every vertex on it then takes its normal from
+		for (auto& v : vertex) v[2] = v[0];
+		auto& normal = mesh->mNormal;
+		normal.assign(numPos, Math::vec3{});
+		gatherCorners(threads, numThreads, corner, numPos, [&](int v, int id) { normal[v] = normal[v] + faceNormal[id]; }, [&](int st, int ed) {
+			for (int v = st; v < ed; v++) normal[v] = normal[v].normalized();
+			});
+	}
+
+	void genTangents(ThreadPool& threads, int numThreads) { //按uv方向生成切线，每个法线一个，供法线贴图使用
+		auto& vertex = mesh->vertex;
+		auto& index = mesh->index;
+		int numFaces = index.size() / 3, numNormals = mesh->mNormal.size(), numUV = mesh->texCoord.size();
+
+		//1 the directions of growing u and v on every face, scaled by its area over its uv area
+		std::vector<std::array<int, 3>> corner(numFaces);
+		std::vector<Math::vec3> faceU(numFaces), faceV(numFaces);
+		auto faceTask = [&](int st, int ed) {
+			for (int id = st; id < ed; id++) {
+				const std::array<int, 3> face[3] = { vertex[index[3 * id]], vertex[index[3 * id + 1]], vertex[index[3 * id + 2]] };
+				for (int i = 0; i < 3; i++) corner[id][i] = face[i][2];
+				faceU[id] = faceV[id] = Math::vec3{};
+				if (face[0][1] >= numUV || face[1][1] >= numUV || face[2][1] >= numUV) continue;
+
+				Math::vec3 e1 = mesh->mPos[face[1][0]] - mesh->mPos[face[0][0]], e2 = mesh->mPos[face[2][0]] - mesh->mPos[face[0][0]];
+				Math::vec2 d1 = mesh->texCoord[face[1][1]] - mesh->texCoord[face[0][1]], d2 = mesh->texCoord[face[2][1]] - mesh->texCoord[face[0][1]];
+				float r = d1[0] * d2[1] - d2[0] * d1[1];
+				if (r == 0) continue;
+				faceU[id] = (e1 * d2[1] - e2 * d1[1]) / r;
+				faceV[id] = (e2 * d1[0] - e1 * d2[0]) / r;
+			}
+			};
+		int blockSize = std::max(std::min(numFaces / (4 * numThreads), 8192), 1);
+		for (int i = 0; i < numFaces; i += blockSize) {
+			threads.addTask(faceTask, i, std::min(i + blockSize, numFaces));
+		}
+		threads.barrier();
+
+		//2 summed around every normal and made orthogonal to it, w is -1 where the uv are mirrored
+		std::vector<Math::vec3> u(numNormals), v(numNormals);
+		auto& tangent = mesh->mTangent;
+		tangent.resize(numNormals);
+		gatherCorners(threads, numThreads, corner, numNormals, [&](int n, int id) { u[n] = u[n] + faceU[id], v[n] = v[n] + faceV[id]; }, [&](int st, int ed) {
+			for (int i = st; i < ed; i++) {
+				Math::vec3 n = mesh->mNormal[i];
+				Math::vec3 t = u[i] - n * n.dot(u[i]);
+				if (t.dot(t) == 0) t = n.cross(std::abs(n[0]) < 0.9f ? Math::vec3{ 1,0,0 } : Math::vec3{ 0,1,0 });		//uv collapsed to a point
+				float len = sqrtf(t.dot(t));
+				if (len > 0) t = t / len;
+				tangent[i] = { t[0], t[1], t[2], n.cross(t).dot(v[i]) < 0 ? -1.f : 1.f };
+			}
+			});
+	}
+	template<class It>
+	Bounds calcBounds(It first, It last) {
+		Bounds b;
+		if (first == last) return b;
+
+		b.min = b.max = mesh->mPos[*first];
+		for (It it = first; it != last; it++) {
+			auto& p = mesh->mPos[*it];
+			for (int k = 0; k < 3; k++) {
+				b.min[k] = std::min(b.min[k], p[k]);
+				b.max[k] = std::max(b.max[k], p[k]);
 			}
-			Math::vec3 mNormal = (mPos[0] - mPos[1]).cross(mPos[1] - mPos[2]);
-			for (int i = 0; i < 3; i++) {
-				adjFacesNormal[face[i][0]].push_back(mNormal);
+		}
+		b.center = (b.min + b.max) * 0.5f;
+		for (It it = first; it != last; it++) {
+			Math::vec3 d = mesh->mPos[*it] - b.center;
+			b.radius = std::max(b.radius, d.dot(d));
+		}
+		b.radius = sqrtf(b.radius);
+		return b;
+	}
+
+	void genClusters(const std::vector<std::array<int, 3>>& vertex, std::vector<uint32_t>& index, MeshLod& lod) { //按重心的Morton码排序三角形，沿相邻三角形生长meshlet，每个最多64个顶点、124个三角形
+		const int maxVertices = 64, maxTriangles = 124;
+
+		auto spread = [](uint32_t v) {		//10 bits -> every third bit
+			v = (v | v << 16) & 0x030000ff;
+			v = (v | v << 8) & 0x0300f00f;
+			v = (v | v << 4) & 0x030c30c3;
+			v = (v | v << 2) & 0x09249249;
+			return v;
+			};
+
+		int num = index.size() / 3;
+		auto posID = [&](int id, int j) { return vertex[index[3 * id + j]][0]; };
+		std::vector<uint32_t> code(num);
+		Math::vec3 extent = mesh->bounds.max - mesh->bounds.min;
+		for (int id = 0; id < num; id++) {
+			Math::vec3 centroid = (mesh->mPos[posID(id, 0)] + mesh->mPos[posID(id, 1)] + mesh->mPos[posID(id, 2)]) * (1.f / 3.f);
+			code[id] = 0;
+			for (int k = 0; k < 3; k++) {
+				float t = extent[k] > 0 ? (centroid[k] - mesh->bounds.min[k]) / extent[k] : 0.f;
+				code[id] |= spread((uint32_t)std::min(std::max(t * 1023.f, 0.f), 1023.f)) << k;
 			}
 		}
 
-		mesh.mNormal.resize(mesh.mPos.size());
+		std::vector<int> morton(num);
+		std::iota(morton.begin(), morton.end(), 0);
+		std::stable_sort(morton.begin(), morton.end(), [&](int a, int b) { return code[a] < code[b]; });
 
-		for (int i = 0; i < mesh.mPos.size(); i++) {
+		//1 find the faces around every position
+		std::vector<int> adjFirst(mesh->mPos.size() + 1, 0), adj(3 * num);
+		for (int id = 0; id < num; id++) {
+			for (int j = 0; j < 3; j++) adjFirst[posID(id, j) + 1]++;
+		}
+		for (int i = 0; i < mesh->mPos.size(); i++) adjFirst[i + 1] += adjFirst[i];
+		std::vector<int> cursor(adjFirst.begin(), adjFirst.end() - 1);
+		for (int id = 0; id < num; id++) {
+			for (int j = 0; j < 3; j++) adj[cursor[posID(id, j)]++] = id;
+		}
+
+		std::vector<Math::vec3> faceNormal(num);
+		for (int id = 0; id < num; id++) {
+			Math::vec3 n = (mesh->mPos[posID(id, 1)] - mesh->mPos[posID(id, 0)]).cross(mesh->mPos[posID(id, 2)] - mesh->mPos[posID(id, 0)]);
+			float len = sqrtf(n.dot(n));
+			if (len > 0) faceNormal[id] = n / len;
+		}
+
+		//2 grow every meshlet from the first unused face in Morton order, taking the adjacent face
+		//that adds the fewest vertices and, among those, bends least away from the meshlet's normal
+		std::vector<int> order, first;
+		std::vector<int> stamp(vertex.size(), -1);
+		std::vector<char> used(num, 0);
+		std::vector<int> candidate;
+		order.reserve(num);
+		for (int seed = 0; order.size() < num;) {
+			int meshlet = first.size();
+			first.push_back(order.size());
+
+			int vertices = 0;
+			Math::vec3 axis;
+			candidate.clear();
+			auto newVertices = [&](int id) {
+				int add = 0;
+				for (int j = 0; j < 3; j++) add += stamp[index[3 * id + j]] != meshlet;
+				return add;
+				};
+
+			while (used[morton[seed]]) seed++;
+			for (int next = morton[seed]; next >= 0;) {
+				used[next] = 1;
+				order.push_back(next);
+				vertices += newVertices(next);
+				axis = axis + faceNormal[next];
+				for (int j = 0; j < 3; j++) {
+					stamp[index[3 * next + j]] = meshlet;
+					int p = posID(next, j);
+					candidate.insert(candidate.end(), adj.begin() + adjFirst[p], adj.begin() + adjFirst[p + 1]);
+				}
+				if (order.size() - first.back() == maxTriangles) break;
+
+				next = -1;
+				int bestAdd = 4;
+				float bestDot = 0;
+				candidate.erase(std::remove_if(candidate.begin(), candidate.end(), [&](int id) { return used[id]; }), candidate.end());
+				for (int id : candidate) {
+					int add = newVertices(id);
+					float dot = axis.dot(faceNormal[id]);
+					if (vertices + add > maxVertices) continue;
+					if (add < bestAdd || (add == bestAdd && dot > bestDot)) next = id, bestAdd = add, bestDot = dot;
+				}
+				if (candidate.empty() && vertices + 3 <= maxVertices) {		//disconnected, continue in Morton order
+					while (seed < num && used[morton[seed]]) seed++;
+					if (seed < num) next = morton[seed];
+				}
+			}
+		}
+		first.push_back(num);
 
-			float totArea = 0;
-			for (int j = 0; j < adjFacesNormal[i].size(); j++) {
-				totArea += sqrt(adjFacesNormal[i][j].dot(adjFacesNormal[i][j]));
+		//3 store the faces meshlet by meshlet, each with its own copy of the vertices it uses
+		std::vector<uint32_t> sorted(3 * num);
+		for (int id = 0; id < num; id++) {
+			for (int j = 0; j < 3; j++) sorted[3 * id + j] = index[3 * order[id] + j];
+		}
+		index = std::move(sorted);
+
+		lod.cluster.clear();
+		lod.clusterVertex.clear();
+		lod.clusterIndex.resize(num);
+		std::fill(stamp.begin(), stamp.end(), -1);
+		std::vector<int> local(vertex.size());
+		std::vector<int> pos;
+		for (int m = 0; m + 1 < first.size(); m++) {
+			Cluster c;
+			c.first = first[m];
+			c.count = first[m + 1] - first[m];
+			c.vertexFirst = lod.clusterVertex.size();
+
+			pos.clear();
+			for (int id = c.first; id < c.first + c.count; id++) {
+				for (int j = 0; j < 3; j++) {
+					int v = index[3 * id + j];
+					if (stamp[v] != m) {
+						stamp[v] = m;
+						local[v] = lod.clusterVertex.size();
+						lod.clusterVertex.push_back(vertex[v]);
+						pos.push_back(vertex[v][0]);
+					}
+					lod.clusterIndex[id][j] = local[v];
+				}
 			}
-			for (int j = 0; j < adjFacesNormal[i].size(); j++) {
-				float area = sqrt(adjFacesNormal[i][j].dot(adjFacesNormal[i][j]));
-				mesh.mNormal[i] = mesh.mNormal[i] + area / totArea * adjFacesNormal[i][j];
+			c.vertexCount = lod.clusterVertex.size() - c.vertexFirst;
+			c.bounds = calcBounds(pos.begin(), pos.end());
+			calcCone(c, vertex, index);
+			lod.cluster.push_back(c);
+		}
+
+		int numVertices = lod.clusterVertex.size();
+		for (auto* a : { lod.vertexPos, lod.vertexNormal }) {
+			for (int k = 0; k < 3; k++) a[k].assign(numVertices + 8, 0.f);
+		}
+		for (auto& a : lod.vertexUV) a.assign(numVertices + 8, 0.f);
+		for (int i = 0; i < numVertices; i++) {
+			auto& v = lod.clusterVertex[i];
+			for (int k = 0; k < 3; k++) {
+				lod.vertexPos[k][i] = mesh->mPos[v[0]][k];
+				lod.vertexNormal[k][i] = mesh->mNormal[v[2]][k];
 			}
-			mesh.mNormal[i] = mesh.mNormal[i].normalized();
+			if (mesh->texCoord.empty()) continue;
+			for (int k = 0; k < 2; k++) lod.vertexUV[k][i] = mesh->texCoord[v[1]][k];
 		}
 	}
-public:
-	Model(Object object, Matirial mtl): Object(object), mtl(mtl) {}
 
-	bool loadOBJ(const std::wstring& path, const std::wstring _name) {
-		std::wifstream ifs;
-		ifs.open(path + L"/" + _name);
-		if (!ifs.is_open())return false;
+	//normal cone of the cluster's faces, no cone when they spread over more than a hemisphere
+	void calcCone(Cluster& c, const std::vector<std::array<int, 3>>& vertex, const std::vector<uint32_t>& index) {
+		std::vector<Math::vec3> normal;
+		for (int id = c.first; id < c.first + c.count; id++) {
+			auto& p0 = mesh->mPos[vertex[index[3 * id]][0]];
+			Math::vec3 n = (mesh->mPos[vertex[index[3 * id + 1]][0]] - p0).cross(mesh->mPos[vertex[index[3 * id + 2]][0]] - p0);
+			float len = sqrtf(n.dot(n));
+			if (len > 0) normal.push_back(n / len);		//degenerate faces never reach the screen
+		}
 
-		name = _name;
+		Math::vec3 axis;
+		for (auto& n : normal) axis = axis + n;
+		float len = sqrtf(axis.dot(axis));
+		c.coneAxis = len > 0 ? axis / len : Math::vec3{ 0,0,1 };
+		c.coneCutoff = 1.f;
+		if (len == 0) return;
 
-		std::wstring str;
-		while (std::getline(ifs, str)) {
-			std::vector<std::wstring> vec = seprateLine(str);
-			if (vec.empty())continue;
-
-			std::wstring mtl;
-			if (vec[0] == L"v") {
-				float x = _wtof(vec[1].c_str());
-				float y = _wtof(vec[2].c_str());
-				float z = _wtof(vec[3].c_str());
-				mesh.mPos.push_back({ x, y, z });
+		float minDot = 1.f;
+		for (auto& n : normal) minDot = std::min(minDot, c.coneAxis.dot(n));
+		if (minDot > 0.f) c.coneCutoff = sqrtf(1.f - minDot * minDot);		//sine of the cone half angle
+	}
+	//sum of squared distances to a set of planes, the upper triangle of the symmetric 4x4 matrix
+	struct Quadric {
+		double q[10] = {};
+
+		void addPlane(const Math::vec3& n, float d, double weight) {
+			double p[4] = { n[0], n[1], n[2], d };
+			for (int i = 0, k = 0; i < 4; i++) {
+				for (int j = i; j < 4; j++) q[k++] += weight * p[i] * p[j];
 			}
-			else if (vec[0] == L"vt") {
-				float u = _wtof(vec[1].c_str());
-				float v = _wtof(vec[2].c_str());
-				mesh.texCoord.push_back({ u, v });
+		}
+		void add(const Quadric& b) {
+			for (int k = 0; k < 10; k++) q[k] += b.q[k];
+		}
+		double eval(const Math::vec3& v) const {
+			double x = v[0], y = v[1], z = v[2];
+			return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+				q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+				q[7] * z * z + 2 * q[8] * z + q[9];
+		}
+	};
+
+	void genLods() { //二次误差度量（QEM）边折叠到端点，每级三角形减半，直到少于minTriangles
+		const int minTriangles = 256;
+		const double borderWeight = 10;		//keeps open borders in place
+
+		auto& mPos = mesh->mPos;
+		int numPos = mPos.size();
+		int num = mesh->index.size() / 3;
+
+		std::vector<std::array<int, 3>> face(num), faceNormal(num), faceTex(num);
+		std::vector<int> vertexNormal(numPos, 0), vertexTex(numPos, 0);		//normal and uv ids a moved corner takes over
+		std::vector<std::vector<int>> vertexFace(numPos);
+		for (int id = 0; id < num; id++) {
+			for (int j = 0; j < 3; j++) {
+				auto& v = mesh->vertex[mesh->index[3 * id + j]];
+				face[id][j] = v[0];
+				faceNormal[id][j] = v[2];
+				faceTex[id][j] = v[1];
+				vertexNormal[face[id][j]] = faceNormal[id][j];
+				vertexTex[face[id][j]] = faceTex[id][j];
+				vertexFace[face[id][j]].push_back(id);
+			}
+		}
+
+		auto planeNormal = [&](const std::array<int, 3>& f) {
+			return (mPos[f[1]] - mPos[f[0]]).cross(mPos[f[2]] - mPos[f[0]]);
+			};
+
+		//1 quadrics of the face planes, plus planes standing on the border edges
+		std::vector<Quadric> quadric(numPos);
+		std::unordered_map<uint64_t, int> edgeCount;
+		auto edgeKey = [](int a, int b) { return (uint64_t)(uint32_t)std::min(a, b) << 32 | (uint32_t)std::max(a, b); };
+		for (auto& f : face) {
+			Math::vec3 n = planeNormal(f);
+			float len = sqrtf(n.dot(n));
+			if (len > 0) {
+				n = n / len;
+				for (int j = 0; j < 3; j++) quadric[f[j]].addPlane(n, -n.dot(mPos[f[0]]), 1);
 			}
-			else if (vec[0] == L"vn") {
-				float x = _wtof(vec[1].c_str());
-				float y = _wtof(vec[2].c_str());
-				float z = _wtof(vec[3].c_str());
-				mesh.mNormal.push_back({ x, y, z });
+			for (int j = 0; j < 3; j++) edgeCount[edgeKey(f[j], f[(j + 1) % 3])]++;
+		}
+		for (auto& f : face) {
+			Math::vec3 n = planeNormal(f);
+			for (int j = 0; j < 3; j++) {
+				int a = f[j], b = f[(j + 1) % 3];
+				if (edgeCount[edgeKey(a, b)] != 1) continue;
+
+				Math::vec3 border = (mPos[b] - mPos[a]).cross(n);
+				float len = sqrtf(border.dot(border));
+				if (len == 0) continue;
+				border = border / len;
+				quadric[a].addPlane(border, -border.dot(mPos[a]), borderWeight);
+				quadric[b].addPlane(border, -border.dot(mPos[a]), borderWeight);
 			}
-			else if (vec[0] == L"usemtl") {
-				mtl = vec[1];
+		}
+
+		//2 collapse the cheapest edge first, heap entries are dropped once either end has changed
+		struct Collapse {
+			double cost;
+			int from, to;
+			int versionFrom, versionTo;
+			bool operator > (const Collapse& b) const { return cost > b.cost; }
+		};
+		std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+		std::vector<int> version(numPos, 0);
+		std::vector<char> removed(num, 0), dead(numPos, 0);
+
+		auto pushEdge = [&](int a, int b) {
+			Quadric q = quadric[a];
+			q.add(quadric[b]);
+			double ca = q.eval(mPos[a]), cb = q.eval(mPos[b]);
+			if (ca <= cb) heap.push({ std::max(ca, 0.0), b, a, version[b], version[a] });
+			else heap.push({ std::max(cb, 0.0), a, b, version[a], version[b] });
+			};
+		for (auto& [key, count] : edgeCount) pushEdge((int)(key >> 32), (int)(uint32_t)key);
+
+		auto collapse = [&](int u, int v) {
+			for (int f : vertexFace[u]) {		//reject collapses that flip a face
+				auto& F = face[f];
+				if (removed[f] || F[0] == v || F[1] == v || F[2] == v) continue;
+				std::array<int, 3> moved = F;
+				for (auto& w : moved) if (w == u) w = v;
+				if (planeNormal(F).dot(planeNormal(moved)) <= 0) return false;
 			}
-			else if (vec[0] == L"f") {
-				if (vec.size() == 4) {
-					std::vector<int> posTexNormA = seprate(vec[1]);
-					std::vector<int> posTexNormB = seprate(vec[2]);
-					std::vector<int> posTexNormC = seprate(vec[3]);
-					std::vector<std::vector<int>> tri;
-					tri.push_back(posTexNormA);
-					tri.push_back(posTexNormB);
-					tri.push_back(posTexNormC);
-					mesh.tInfo.push_back(tri);
+
+			for (int f : vertexFace[u]) {
+				auto& F = face[f];
+				if (removed[f]) continue;
+				if (F[0] == v || F[1] == v || F[2] == v) {
+					removed[f] = 1;
+					num--;
+					continue;
 				}
-				else if (vec.size() == 5) {
-					std::vector<int> posTexNormA = seprate(vec[1]);
-					std::vector<int> posTexNormB = seprate(vec[2]);
-					std::vector<int> posTexNormC = seprate(vec[3]);
-					std::vector<int> posTexNormD = seprate(vec[4]);
-					std::vector<std::vector<int>> tri1;
-					tri1.push_back(posTexNormA);
-					tri1.push_back(posTexNormB);
-					tri1.push_back(posTexNormC);
-					mesh.tInfo.push_back(tri1);
-					std::vector<std::vector<int>> tri2;
-					tri2.push_back(posTexNormA);
-					tri2.push_back(posTexNormC);
-					tri2.push_back(posTexNormD);
-					mesh.tInfo.push_back(tri2);
+				for (int j = 0; j < 3; j++) {
+					if (F[j] == u) F[j] = v, faceNormal[f][j] = vertexNormal[v], faceTex[f][j] = vertexTex[v];
 				}
+				vertexFace[v].push_back(f);
+			}
+			std::vector<int>().swap(vertexFace[u]);
+			dead[u] = 1;
+			quadric[v].add(quadric[u]);
+			version[v]++;
+
+			auto& vf = vertexFace[v];
+			vf.erase(std::remove_if(vf.begin(), vf.end(), [&](int f) { return removed[f]; }), vf.end());
+			for (int f : vf) {
+				for (int w : face[f]) if (w != v) pushEdge(v, w);
 			}
+			return true;
+			};
+
+		//3 keep a level whenever the triangle count halved
+		double maxCost = 0;
+		for (int target = num / 2; target >= minTriangles; target = num / 2) {
+			int last = num;
+			while (num > target && !heap.empty()) {
+				Collapse c = heap.top();
+				heap.pop();
+				if (dead[c.from] || dead[c.to] || version[c.from] != c.versionFrom || version[c.to] != c.versionTo) continue;
+				if (collapse(c.from, c.to)) maxCost = std::max(maxCost, c.cost);
+			}
+			if (num > last * 3 / 4) break;		//stuck on flips or borders
+
+			std::vector<std::array<int, 3>> corner, vertex;
+			std::vector<uint32_t> index;
+			corner.reserve(3 * num);
+			for (int id = 0; id < face.size(); id++) {
+				if (removed[id]) continue;
+				for (int j = 0; j < 3; j++) corner.push_back({ face[id][j], faceTex[id][j], faceNormal[id][j] });
+			}
+			indexCorners(corner, numPos, vertex, index);
+			MeshLod lod;
+			lod.error = sqrt(maxCost);
+			genClusters(vertex, index, lod);
+			mesh->lod.push_back(std::move(lod));
+		}
+	}
+	//of the material library only the first diffuse map is used, and only as a binary ppm
+	void loadMTL(const std::filesystem::path& file) {
+		std::ifstream ifs(file);
+		std::string str;
+		while (std::getline(ifs, str)) {
+			std::istringstream line(str);
+			std::string key, map;
+			line >> key;
+			if (key != "map_Kd") continue;
+			while (line >> map);		//options come before the file name
+
+			auto texture = std::make_shared<Texture>();
+			if (!map.empty() && texture->loadPPM(file.parent_path() / utf8Path(map))) mesh->diffuseMap = texture;
+			return;
+		}
+	}
+
+	//the mesh as written in the obj, mtllib is the first material library it names
+	bool parseOBJ(const std::filesystem::path& path, ThreadPool& threads, int numThreads, std::string& mtllib) {
+		MappedFile file;
+		if (!file.open(path))return false;
+
+		//1 the file cut into chunks that end after a line break, parsed in parallel
+		const char* data = file.data();
+		const char* end = data + file.size();
+		size_t chunkSize = std::max(file.size() / (4 * numThreads), (size_t)1 << 20);
+		std::vector<const char*> cut = { data };
+		while (cut.back() != end) {
+			const char* next = cut.back() + std::min(chunkSize, (size_t)(end - cut.back()));
+			next = std::find(next, end, '\n');
+			cut.push_back(next == end ? end : next + 1);
 		}
-		if (mesh.mNormal.empty()) {
-			noNormal = true;
-			genNormals();
+		int numChunks = cut.size() - 1;
+		std::vector<ObjChunk> chunk(numChunks);
+		auto parseTask = [&](int i) {
+			parseChunk(cut[i], cut[i + 1], chunk[i]);
+			};
+		for (int i = 0; i < numChunks; i++) {
+			threads.addTask(parseTask, i);
 		}
-		if (mesh.texCoord.empty()) {
-			noUV = true;
+		threads.barrier();
+
+		//2 the chunks appended in file order, negative indices resolved and every index checked against its array
+		std::vector<std::array<int, 3>> first(numChunks + 1);			//pos, tex, normal before each chunk
+		std::vector<int> firstTriangle(numChunks + 1, 0);
+		for (int i = 0; i < numChunks; i++) {
+			first[i + 1] = { first[i][0] + (int)chunk[i].pos.size(), first[i][1] + (int)chunk[i].texCoord.size(), first[i][2] + (int)chunk[i].normal.size() };
+			firstTriangle[i + 1] = firstTriangle[i] + chunk[i].corner.size() / 3;
+		}
+		std::array<int, 3> total = first[numChunks];
+		mesh->mPos.resize(total[0]);
+		mesh->texCoord.resize(total[1]);
+		mesh->mNormal.resize(total[2]);
+		std::vector<std::array<int, 3>> corner(3 * (size_t)firstTriangle[numChunks]);
+		std::vector<char> invalid(numChunks, 0);
+		auto mergeTask = [&](int i) {
+			ObjChunk& c = chunk[i];
+			std::copy(c.pos.begin(), c.pos.end(), mesh->mPos.begin() + first[i][0]);
+			std::copy(c.texCoord.begin(), c.texCoord.end(), mesh->texCoord.begin() + first[i][1]);
+			std::copy(c.normal.begin(), c.normal.end(), mesh->mNormal.begin() + first[i][2]);
+			for (auto [corner, j] : c.relative) c.corner[corner][j] += first[i][j];
+			for (auto& v : c.corner) {
+				for (int j = 0; j < 3; j++) {
+					if (total[j] == 0) v[j] = 0;		//only the positions must be there
+					if (j == 0 || total[j] > 0) invalid[i] |= (unsigned)v[j] >= (unsigned)total[j];
+				}
+			}
+			std::copy(c.corner.begin(), c.corner.end(), corner.begin() + 3 * (size_t)firstTriangle[i]);
+			};
+		for (int i = 0; i < numChunks; i++) {
+			threads.addTask(mergeTask, i);
+		}
+		threads.barrier();
+		if (std::find(invalid.begin(), invalid.end(), 1) != invalid.end()) return false;
+
+		//3 the distinct corners become the vertices
+		indexCorners(corner, total[0], mesh->vertex, mesh->index);
+		for (auto& c : chunk) {
+			if (c.mtllib.empty()) continue;
+			mtllib = c.mtllib;
+			break;
 		}
 		return true;
 	}
 
+	//one pool for every load, started by the first
+	static ThreadPool& loadThreads() {
+		static ThreadPool threads(std::max((int)std::thread::hardware_concurrency(), 1));
+		return threads;
+	}
+public:
+	Model(Object object, Matirial mtl): Object(object), mtl(mtl) {}
+
+	//another model drawing the same mesh
+	Model instance(Object object, Matirial mtl) const {
+		Model ret(*this);
+		static_cast<Object&>(ret) = object;
+		ret.mtl = mtl;
+		return ret;
+	}
+
+	//tangents are only generated on request, for models with uv;
+	//the mesh and all derived from it is cached in <name>.cache next to the obj and read back from there until the obj changes
+	bool loadOBJ(const std::wstring& path, const std::wstring _name, bool tangents = false) {
+		std::filesystem::path file = std::filesystem::path(path) / _name, cacheFile = file;
+		cacheFile += ".cache";
+		std::shared_ptr<Mesh> previous = mesh;
+		mesh = std::make_shared<Mesh>();
+
+		int numThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+		ThreadPool& threads = loadThreads();
+		std::string mtllib;
+		bool generatedNormals = false;
+		if (MeshCache::load(cacheFile, file, *mesh, generatedNormals, mtllib)) {
+			if (tangents && !mesh->texCoord.empty() && mesh->mTangent.empty()) genTangents(threads, numThreads);
+		}
+		else {
+			mesh = std::make_shared<Mesh>();
+			mtllib.clear();
+			if (!parseOBJ(file, threads, numThreads, mtllib)) {
+				mesh = previous;
+				return false;
+			}
+			generatedNormals = mesh->mNormal.empty();
+			if (generatedNormals) genNormals(threads, numThreads);
+			if (tangents && !mesh->texCoord.empty()) genTangents(threads, numThreads);
+
+			std::vector<int> all(mesh->mPos.size());
+			std::iota(all.begin(), all.end(), 0);
+			mesh->bounds = calcBounds(all.begin(), all.end());
+
+			mesh->lod.resize(1);
+			genClusters(mesh->vertex, mesh->index, mesh->lod[0]);
+			genLods();
+			MeshCache::save(cacheFile, file, *mesh, generatedNormals, mtllib);
+		}
+		if (!mtllib.empty()) loadMTL(std::filesystem::path(path) / utf8Path(mtllib));
+
+		name = _name;
+		version = newVersion();
+		noNormal = generatedNormals;
+		noUV = mesh->texCoord.empty();
+		return true;
+	}
+
 	const Math::mat4 calcMatrixM() const {
 		Math::vec3 gxup = g.cross(up);
 		Math::mat4 translate = {
@@ -353,20 +953,45 @@ public:
 		swprintf(str, 512,
 			LR"(
 model attributes:
-name: %s
+name: %ls
 vertices: %llu
-normals: %llu %s
+normals: %llu %ls
 triangles: %llu
+meshlets: %llu
+LODs: %llu
 )",
 name.c_str(),
-mesh.mPos.size(),
-mesh.mNormal.size(), noNormal ? L"(AutoGen)" : L"", 
-mesh.tInfo.size());
+mesh->mPos.size(),
+mesh->mNormal.size(), noNormal ? L"(AutoGen)" : L"", 
+mesh->index.size() / 3,
+mesh->lod[0].cluster.size(),
+mesh->lod.size());
 
 		return std::wstring(str) + Object::debugInfo();
 	}
 };
 
+//every model of the scene is drawn in one pipeline pass
+struct Scene {
+	std::vector<Model> model;
+
+	void updateAtiitude() {
+		for (auto& m : model) m.updateAtiitude();
+	}
+
+	std::wstring debugInfo() const {
+		wchar_t str[512];
+		swprintf(str, 512,
+			LR"(
+scene:
+models: %llu
+)",
+model.size());
+
+		return std::wstring(str) + (model.empty() ? L"" : model[0].debugInfo());
+	}
+};
+
 struct Timer {
 	std::chrono::time_point<std::chrono::steady_clock> start;
 
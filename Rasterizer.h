@@ -0,0 +1,214 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#endif
+
+//fixed point half-space rasterizer working on 8x8 pixel blocks
+namespace Raster {
+	static constexpr int subBits = 4;					//1/16 pixel vertex precision
+	static constexpr int subPixel = 1 << subBits;
+	static constexpr int blockSize = 8;
+	static constexpr float maxCoord = 1 << 14;			//keeps one block of any edge function inside int32
+
+	//lanes where e + off[lane] >= 0 for every edge set in test
+	inline int coverage8(int test, const int32_t e[3], const int32_t off[3][blockSize]) {
+#if defined(__AVX2__)
+		__m256i mask = _mm256_set1_epi32(-1);
+		for (int i = 0; i < 3; i++) {
+			if (!(test >> i & 1)) continue;
+			__m256i v = _mm256_add_epi32(_mm256_set1_epi32(e[i]), _mm256_load_si256((const __m256i*)off[i]));
+			mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(v, _mm256_set1_epi32(-1)));
+		}
+		return _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		__m128i lo = _mm_set1_epi32(-1), hi = _mm_set1_epi32(-1);
+		for (int i = 0; i < 3; i++) {
+			if (!(test >> i & 1)) continue;
+			__m128i base = _mm_set1_epi32(e[i]);
+			__m128i vlo = _mm_add_epi32(base, _mm_load_si128((const __m128i*)off[i]));
+			__m128i vhi = _mm_add_epi32(base, _mm_load_si128((const __m128i*)off[i] + 1));
+			lo = _mm_and_si128(lo, _mm_cmpgt_epi32(vlo, _mm_set1_epi32(-1)));
+			hi = _mm_and_si128(hi, _mm_cmpgt_epi32(vhi, _mm_set1_epi32(-1)));
+		}
+		return _mm_movemask_ps(_mm_castsi128_ps(lo)) | _mm_movemask_ps(_mm_castsi128_ps(hi)) << 4;
+#else
+		int mask = (1 << blockSize) - 1;
+		for (int i = 0; i < 3; i++) {
+			if (!(test >> i & 1)) continue;
+			for (int l = 0; l < blockSize; l++) {
+				if (e[i] + off[i][l] < 0) mask &= ~(1 << l);
+			}
+		}
+		return mask;
+#endif
+	}
+
+	//snap to the 1/16 grid, false if the vertex is outside the fixed point range
+	inline bool snap(const float vx[3], const float vy[3], int64_t X[3], int64_t Y[3]) {
+		for (int i = 0; i < 3; i++) {
+			if (!(std::abs(vx[i]) < maxCoord && std::abs(vy[i]) < maxCoord)) return false;
+			X[i] = (int64_t)std::floor(vx[i] * subPixel + 0.5f);
+			Y[i] = (int64_t)std::floor(vy[i] * subPixel + 0.5f);
+		}
+		return true;
+	}
+
+	//the weights rasterize passes to frag for pixel (x, y), without the coverage test
+	inline bool weights(const float vx[3], const float vy[3], int x, int y, float& alpha, float& beta, float& gama) {
+		int64_t X[3], Y[3], E[3];
+		if (!snap(vx, vy, X, Y)) return false;
+
+		for (int i = 0, j = 1; i < 3; i++, j = (j + 1) % 3) {
+			E[i] = (Y[i] - Y[j]) * x * subPixel + (X[j] - X[i]) * y * subPixel + X[i] * Y[j] - X[j] * Y[i];
+		}
+		float invArea = 1.f / (E[0] + E[1] + E[2]);
+		alpha = E[1] * invArea, beta = E[2] * invArea, gama = E[0] * invArea;
+		return true;
+	}
+
+	//4x rotated grid, sample offsets from the pixel in 1/16 pixels
+	static constexpr int numSamples = 4;
+	static constexpr int sampleX[numSamples] = { -2, 6, -6, 2 };
+	static constexpr int sampleY[numSamples] = { -6, -2, 2, 6 };
+	static constexpr int sampleReach = 6;
+
+	/*
+	rasterize the triangle (vx, vy) inside the pixel rect [x0, x1] x [y0, y1], pixel (x, y) is sampled at (x, y)
+	edges are integer functions of 1/16 snapped vertices with a top-left fill rule, so shared edges are covered exactly once
+	every 8x8 block is trivially accepted, trivially rejected or tested 8 pixels at a time
+	frag(x, y, alpha, beta, gama) gets the screen space weights of vertex 0, 1, 2
+	with multisample the 4 samples of every pixel are tested instead and frag(x, y, mask, alpha, beta, gama) gets the
+	covered ones in mask, the weights are those of (x, y) when every sample is covered, else of the first covered sample,
+	so attributes are never extrapolated past the edge
+	block(bx, by) may skip a block the triangle touches before any per-pixel work, e.g. when it is occluded
+	returns false without drawing when a vertex is outside the fixed point range
+	*/
+	template<bool multisample, class F, class K>
+	bool rasterize(const float vx[3], const float vy[3], int x0, int y0, int x1, int y1, F&& frag, K&& block) {
+		int64_t X[3], Y[3];
+		if (!snap(vx, vy, X, Y)) return false;
+
+		//E(P) = A * Px + B * Py + C, positive on the inner side of edge i -> j
+		int64_t A[3], B[3], C[3], bias[3];
+		for (int i = 0, j = 1; i < 3; i++, j = (j + 1) % 3) {
+			A[i] = Y[i] - Y[j];
+			B[i] = X[j] - X[i];
+			C[i] = X[i] * Y[j] - X[j] * Y[i];
+			bias[i] = A[i] > 0 || (A[i] == 0 && B[i] < 0) ? 0 : -1;		//top-left rule
+		}
+		int64_t area = C[0] + C[1] + C[2];
+		if (area <= 0) return true;
+
+		//pixel bounding box, grown by the sample offsets
+		const int reach = multisample ? sampleReach : 0;
+		auto ceilPixel = [](int64_t v) { return (int)-((-v) >> subBits); };
+		auto floorPixel = [](int64_t v) { return (int)(v >> subBits); };
+		int xs = std::max(x0, ceilPixel(std::min(std::min(X[0], X[1]), X[2]) - reach));
+		int xe = std::min(x1, floorPixel(std::max(std::max(X[0], X[1]), X[2]) + reach));
+		int ys = std::max(y0, ceilPixel(std::min(std::min(Y[0], Y[1]), Y[2]) - reach));
+		int ye = std::min(y1, floorPixel(std::max(std::max(Y[0], Y[1]), Y[2]) + reach));
+		if (xs > xe || ys > ye) return true;
+
+		int32_t stepX[3], stepY[3];
+		int32_t sampleOff[3][numSamples], sampleLo[3] = {}, sampleHi[3] = {};
+		alignas(32) int32_t off[3][blockSize];
+		for (int i = 0; i < 3; i++) {
+			stepX[i] = (int32_t)(A[i] * subPixel);
+			stepY[i] = (int32_t)(B[i] * subPixel);
+			for (int l = 0; l < blockSize; l++) off[i][l] = l * stepX[i];
+			if (!multisample) continue;
+
+			for (int k = 0; k < numSamples; k++) {
+				sampleOff[i][k] = (int32_t)(A[i] * sampleX[k] + B[i] * sampleY[k]);
+				sampleLo[i] = std::min(sampleLo[i], sampleOff[i][k]);
+				sampleHi[i] = std::max(sampleHi[i], sampleOff[i][k]);
+			}
+		}
+
+		float invArea = 1.f / area;
+		const int full = (1 << numSamples) - 1;
+		auto emit = [&](int x, int y, int mask, int64_t e0, int64_t e1, int64_t e2) {
+			if constexpr (multisample) {
+				if (mask != full) {
+					int k = std::countr_zero((unsigned)mask);
+					e0 += sampleOff[0][k], e1 += sampleOff[1][k], e2 += sampleOff[2][k];
+				}
+				frag(x, y, mask, e1 * invArea, e2 * invArea, e0 * invArea);
+			}
+			else frag(x, y, e1 * invArea, e2 * invArea, e0 * invArea);
+			};
+
+		const int span = blockSize - 1;
+		for (int by = ys & ~span; by <= ye; by += blockSize) {
+			for (int bx = xs & ~span; bx <= xe; bx += blockSize) {
+				int64_t E[3];
+				int test = 0;
+				bool reject = false;
+				for (int i = 0; i < 3; i++) {
+					E[i] = A[i] * bx * subPixel + B[i] * by * subPixel + C[i];
+					int64_t lo = E[i] + bias[i] + sampleLo[i] + std::min(0, span * stepX[i]) + std::min(0, span * stepY[i]);
+					int64_t hi = E[i] + bias[i] + sampleHi[i] + std::max(0, span * stepX[i]) + std::max(0, span * stepY[i]);
+					if (hi < 0) reject = true;
+					else if (lo < 0) test |= 1 << i;
+				}
+				if (reject || !block(bx, by)) continue;
+
+				if (!test && bx >= x0 && bx + span <= x1 && by >= y0 && by + span <= y1) {		//trivially accepted
+					for (int r = 0; r < blockSize; r++) {
+						for (int l = 0; l < blockSize; l++) {
+							emit(bx + l, by + r, full,
+								E[0] + l * stepX[0] + r * stepY[0],
+								E[1] + l * stepX[1] + r * stepY[1],
+								E[2] + l * stepX[2] + r * stepY[2]);
+						}
+					}
+					continue;
+				}
+
+				int rectMask = 0;
+				for (int l = 0; l < blockSize; l++) {
+					if (bx + l >= xs && bx + l <= xe) rectMask |= 1 << l;
+				}
+				for (int y = std::max(by, ys); y <= std::min(by + span, ye); y++) {
+					int r = y - by;
+					int32_t e[3];
+					int mask = 0;
+					uint32_t lanes = 0;		//coverage of sample k in byte k
+					for (int k = 0; k < (multisample ? numSamples : 1); k++) {
+						for (int i = 0; i < 3; i++) {
+							if (test >> i & 1) e[i] = (int32_t)(E[i] + bias[i] + r * stepY[i] + (multisample ? sampleOff[i][k] : 0));
+						}
+						int covered = rectMask & coverage8(test, e, off);
+						lanes |= covered << 8 * k;
+						mask |= covered;
+					}
+					while (mask) {
+						int l = std::countr_zero((unsigned)mask);
+						mask &= mask - 1;
+						//gather bit l of every byte into the sample mask of pixel l
+						int samples = (lanes >> l & 0x01010101u) * 0x01020408u >> 24;
+						emit(bx + l, y, samples,
+							E[0] + l * stepX[0] + r * stepY[0],
+							E[1] + l * stepX[1] + r * stepY[1],
+							E[2] + l * stepX[2] + r * stepY[2]);
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	template<class F, class K>
+	bool rasterize(const float vx[3], const float vy[3], int x0, int y0, int x1, int y1, F&& frag, K&& block) {
+		return rasterize<false>(vx, vy, x0, y0, x1, y1, frag, block);
+	}
+
+	template<class F>
+	bool rasterize(const float vx[3], const float vy[3], int x0, int y0, int x1, int y1, F&& frag) {
+		return rasterize<false>(vx, vy, x0, y0, x1, y1, frag, [](int, int) { return true; });
+	}
+}
@@ -1,9 +1,20 @@
-#pragma once
+﻿#pragma once
 #include "Math.h"
 #include "Base.h"
 #include "Objects.h"
 #include "Thread.h"
 #include "Canvas.h"
+#include "Rasterizer.h"
+#include <atomic>
+#include <bit>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cwchar>
+#include <memory>
+#include <optional>
+#include <span>
 
 struct Setting {
 	enum Mod {
@@ -13,15 +24,35 @@ struct Setting {
 	};
 	Mod mod = PhongShading;
 	bool backfaceCulling = true;
+	bool visibilityBuffer = false;		//rasterize depth|triangle id first, shade each pixel once afterwards
+	bool msaa = false;					//4 depth samples per pixel, shaded once per pixel and triangle, not with the visibility buffer
+	float lodError = 1.f;				//pixels a simplified mesh may deviate on screen, 0 always draws the full mesh
+	float frameBudget = 0.f;			//ms per frame dynamic resolution aims at, 0 keeps the canvas resolution
+	bool zPrepass = false;				//depth of the whole tile first, then only the triangles left in front are interpolated, not with msaa
+	bool pipelined = false;				//set up the next frame while the last one is shaded, shown one draw later, forward tiles only
+
+	bool operator==(const Setting&) const = default;
 
 	std::wstring debugInfo() const {
 		wchar_t str[512];
 		swprintf(str, 512,
 			LR"(
-backface culling: %s [ B ]
-color mod: %s [ 1/2/3 ]
+backface culling: %ls [ B ]
+visibility buffer: %ls [ V ]
+MSAA 4x: %ls [ M ]
+Z prepass: %ls [ Z ]
+LOD error: %.1f px [ L ]
+frame budget: %.0f ms [ R ]
+pipelined: %ls [ P ]
+color mod: %ls [ 1/2/3 ]
 )",
 backfaceCulling ? L"enabled" : L"disabled",
+visibilityBuffer ? L"enabled" : L"disabled",
+msaa ? L"enabled" : L"disabled",
+zPrepass ? L"enabled" : L"disabled",
+lodError,
+frameBudget,
+pipelined ? L"enabled" : L"disabled",
 			[this]()->const wchar_t* {
 				if (mod == Setting::Mod::PhongShading)
 					return { L"1.Blinn-Phong shading" };
@@ -36,301 +67,907 @@ backfaceCulling ? L"enabled" : L"disabled",
 	}
 };
 
-struct TempFragBuffer {  //ʱػ
-	static constexpr int maxBatchSize = 4096;
-	std::vector<Fragment>& dst;
-	std::vector<float>& depthBuf;
-	std::mutex& mtx;
-	std::vector<Fragment> buffer;
-
-	TempFragBuffer(std::vector<Fragment>& dst,
-		std::vector<float>& depthBuf,
-		std::mutex& mtx) :
-		dst(dst),
-		depthBuf(depthBuf),
-		mtx(mtx) {
-		buffer.reserve(2 * maxBatchSize);
-	}
+//the lights of a frame sorted into clusters, screen tiles times depth slices growing exponentially from the near
+//to the far plane, a fragment only shades the lights without a radius and the ones whose sphere reaches its cluster
+class LightClusters {
+	static constexpr int tileSize = 64;			//as the raster tiles, so the fragments of a tile share a column of clusters
+	static constexpr int numSlices = 16;
+
+	int width = 0;
+	int tilesX = 0, tilesY = 0;
+	float zNear = 1.f, sliceScale = 0.f;		//slice of view distance d is log(d / zNear) * sliceScale
+	std::vector<int> global;					//lights without a radius
+	std::vector<int> first;						//the lights of cluster c are index[first[c], first[c + 1])
+	std::vector<int> index;
+
+	struct Range {
+		int light;
+		int x0, x1, y0, y1, s0, s1;
+	};
+	std::vector<Range> range;
 
-	~TempFragBuffer() {
-		if (buffer.size())transfer();
+	int slice(float dist) const {
+		return std::min(std::max((int)(std::log(std::max(dist, zNear) / zNear) * sliceScale), 0), numSlices - 1);
 	}
 
-	void transfer() {
-		mtx.lock();
-		for (auto& f : buffer) {
-			if (f.depth > depthBuf[f.pid]) {       //earlyZ
-				depthBuf[f.pid] = f.depth;
-				dst.push_back(f);
+public:
+	//near and far are view distances, V and P the camera's matrices
+	void build(const Math::mat4& V, const Math::mat4& P, float near, float far, const std::vector<Light>& light, int width, int height) {
+		this->width = width;
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		zNear = near;
+		sliceScale = numSlices / std::log(far / near);
+
+		//1 the box of tiles and range of slices every light's sphere touches
+		global.clear();
+		range.clear();
+		for (int i = 0; i < light.size(); i++) {
+			auto& li = light[i];
+			if (li.radius <= 0) {
+				global.push_back(i);
+				continue;
+			}
+			Math::vec4 c = V * Math::vec4{ li.wPos[0], li.wPos[1], li.wPos[2], 1.f };
+			float r = li.radius, dist = -c[2];
+			if (dist + r < near || dist - r > far) continue;
+
+			Range rg{ i, 0, tilesX - 1, 0, tilesY - 1, slice(dist - r), slice(dist + r) };
+			if (dist - r > near) {		//wholly in front of the camera, the projected corners of its box bound it on screen
+				float xmin = FLT_MAX, xmax = -FLT_MAX, ymin = FLT_MAX, ymax = -FLT_MAX;
+				for (int k = 0; k < 8; k++) {
+					Math::vec4 p = P * Math::vec4{ c[0] + (k & 1 ? r : -r), c[1] + (k & 2 ? r : -r), c[2] + (k & 4 ? r : -r), 1.f };
+					float sx = 0.5f * width * (p[0] / p[3] + 1.f), sy = 0.5f * height * (p[1] / p[3] + 1.f);
+					xmin = std::min(xmin, sx), xmax = std::max(xmax, sx);
+					ymin = std::min(ymin, sy), ymax = std::max(ymax, sy);
+				}
+				if (xmax < 0 || ymax < 0 || xmin > width - 1.f || ymin > height - 1.f) continue;
+				rg.x0 = (int)std::max(xmin, 0.f) / tileSize, rg.x1 = (int)std::min(xmax, width - 1.f) / tileSize;
+				rg.y0 = (int)std::max(ymin, 0.f) / tileSize, rg.y1 = (int)std::min(ymax, height - 1.f) / tileSize;
 			}
+			range.push_back(rg);
 		}
-		mtx.unlock();
-		buffer.clear();
+
+		//2 count, then fill the clusters in light order
+		auto forClusters = [&](const Range& rg, auto&& f) {
+			for (int s = rg.s0; s <= rg.s1; s++) {
+				for (int y = rg.y0; y <= rg.y1; y++) {
+					for (int x = rg.x0; x <= rg.x1; x++) f((s * tilesY + y) * tilesX + x);
+				}
+			}
+			};
+		first.assign(tilesX * tilesY * numSlices + 1, 0);
+		for (auto& rg : range) forClusters(rg, [&](int c) { first[c + 1]++; });
+		for (int c = 0; c + 1 < first.size(); c++) first[c + 1] += first[c];
+		index.resize(first.back());
+		std::vector<int> cursor(first.begin(), first.end() - 1);
+		for (auto& rg : range) forClusters(rg, [&](int c) { index[cursor[c]++] = rg.light; });
 	}
 
-	void push_back(const Fragment& fragment) {
-		buffer.push_back(fragment);
-		if (buffer.size() >= maxBatchSize)transfer();
+	//the cluster of a fragment at pixel pid with view space depth
+	int cluster(int pid, float depth) const {
+		int x = pid % width, y = pid / width;
+		return (slice(-depth) * tilesY + y / tileSize) * tilesX + x / tileSize;
 	}
+
+	const std::vector<int>& globalLights() const { return global; }
+	std::span<const int> lights(int cluster) const { return { index.data() + first[cluster], index.data() + first[cluster + 1] }; }
 };
 
 class FragmentShader {
-	const Matirial& mtl;
 	const Camera& camera;
 	const std::vector<Light>& light;
 	const Math::vec3& amb_light;
+	const LightClusters& clusters;
+
+	static constexpr int shininess = 300;
+
+	//x^e by squaring, e is a constant so it is a few multiplies instead of a powf
+	template<int e, class T, class Mul>
+	static T pown(T x, T one, Mul mul) {
+		if constexpr (e == 0) return one;
+		else if constexpr (e == 1) return x;
+		else {
+			T h = pown<e / 2>(mul(x, x), one, mul);
+			return e & 1 ? mul(h, x) : h;
+		}
+	}
+
+	static float pown(float x) {
+		return pown<shininess>(x, 1.f, [](float a, float b) { return a * b; });
+	}
+
+	//(1 - (r / radius)^4)^2, smoothly down to 0 at the light's radius
+	static float falloff(float r2, float radius) {
+		float t = r2 / (radius * radius);
+		float w = std::max(1.f - t * t, 0.f);
+		return w * w;
+	}
+
+	//the lights besides the global ones reaching any of the n fragments, in order
+	std::span<const int> clusterLights(const Fragment* f, int n) const {
+		int c[8] = {};
+		bool same = true;
+		for (int k = 0; k < n; k++) {
+			c[k] = clusters.cluster(f[k].pid, f[k].depth);
+			same &= c[k] == c[0];
+		}
+		if (same) return clusters.lights(c[0]);
+
+		thread_local std::vector<int> merged;
+		merged.clear();
+		for (int k = 0; k < n; k++) {
+			if (std::find(c, c + k, c[k]) != c + k) continue;
+			auto l = clusters.lights(c[k]);
+			merged.insert(merged.end(), l.begin(), l.end());
+		}
+		std::sort(merged.begin(), merged.end());
+		merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+		return merged;
+	}
+
+#if defined(__AVX2__)
+	static __m256 pown(__m256 x) {
+		return pown<shininess>(x, _mm256_set1_ps(1.f), [](__m256 a, __m256 b) { return _mm256_mul_ps(a, b); });
+	}
+
+	static __m256 falloff(__m256 r2, float radius) {
+		__m256 t = _mm256_mul_ps(r2, _mm256_set1_ps(1.f / (radius * radius)));
+		__m256 w = _mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(1.f), _mm256_mul_ps(t, t)), _mm256_setzero_ps());
+		return _mm256_mul_ps(w, w);
+	}
+
+	//8 fragments in structure of arrays form, lane k shades f[k]
+	void run8(const Fragment* f, int n, unsigned int* color) const {
+		alignas(32) float attrib[15][8];		//wPos, wNormal, ka, kd, ks
+		for (int k = 0; k < 8; k++) {
+			const Fragment& fk = f[std::min(k, n - 1)];
+			Math::vec3 kd = diffuseColor(fk);
+			for (int c = 0; c < 3; c++) {
+				attrib[c][k] = fk.wPos[c];
+				attrib[3 + c][k] = fk.wNormal[c];
+				attrib[6 + c][k] = fk.mtl->ka[c];
+				attrib[9 + c][k] = kd[c];
+				attrib[12 + c][k] = fk.mtl->ks[c];
+			}
+		}
+		__m256 p[3], nrm[3], v[3];
+		for (int c = 0; c < 3; c++) {
+			p[c] = _mm256_load_ps(attrib[c]);
+			nrm[c] = _mm256_load_ps(attrib[3 + c]);
+		}
+		auto dot = [](const __m256 a[3], const __m256 b[3]) {
+			return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a[0], b[0]), _mm256_mul_ps(a[1], b[1])), _mm256_mul_ps(a[2], b[2]));
+			};
+
+		for (int c = 0; c < 3; c++) v[c] = _mm256_sub_ps(_mm256_set1_ps(camera.wPos[c]), p[c]);		//object to camera
+		__m256 invV = Math::rsqrt(dot(v, v));
+		for (int c = 0; c < 3; c++) v[c] = _mm256_mul_ps(v[c], invV);
+
+		//light sums per channel, the material is applied once afterwards
+		__m256 diffuse[3], specular[3];
+		for (int c = 0; c < 3; c++) diffuse[c] = specular[c] = _mm256_setzero_ps();
+		const __m256 zero = _mm256_setzero_ps();
+		auto shade = [&](const Light& li) {
+			__m256 l[3], h[3];
+			for (int c = 0; c < 3; c++) l[c] = _mm256_sub_ps(_mm256_set1_ps(li.wPos[c]), p[c]);		//object to lightsource
+			__m256 r2 = dot(l, l);
+			__m256 invR = Math::rsqrt(r2);
+			__m256 invR2 = _mm256_mul_ps(invR, invR);
+			if (li.radius > 0) invR2 = _mm256_mul_ps(invR2, falloff(r2, li.radius));
+			for (int c = 0; c < 3; c++) l[c] = _mm256_mul_ps(l[c], invR);
+
+			for (int c = 0; c < 3; c++) h[c] = _mm256_add_ps(l[c], v[c]);		//half
+			__m256 invH = Math::rsqrt(dot(h, h));
+			for (int c = 0; c < 3; c++) h[c] = _mm256_mul_ps(h[c], invH);
+
+			__m256 d = _mm256_mul_ps(_mm256_max_ps(zero, dot(nrm, l)), invR2);
+			__m256 s = _mm256_mul_ps(pown(_mm256_max_ps(zero, dot(nrm, h))), invR2);
+			for (int c = 0; c < 3; c++) {
+				__m256 intensity = _mm256_set1_ps(li.intensity[c]);
+				diffuse[c] = _mm256_add_ps(diffuse[c], _mm256_mul_ps(intensity, d));
+				specular[c] = _mm256_add_ps(specular[c], _mm256_mul_ps(intensity, s));
+			}
+			};
+		for (int i : clusters.globalLights()) shade(light[i]);
+		for (int i : clusterLights(f, n)) shade(light[i]);
+
+		//clamped to [0, 1] and packed like Canvas::packColor
+		__m256i packed = _mm256_setzero_si256();
+		for (int c = 0; c < 3; c++) {
+			__m256 col = _mm256_mul_ps(_mm256_load_ps(attrib[6 + c]), _mm256_set1_ps(amb_light[c]));
+			col = _mm256_add_ps(col, _mm256_mul_ps(_mm256_load_ps(attrib[9 + c]), diffuse[c]));
+			col = _mm256_add_ps(col, _mm256_mul_ps(_mm256_load_ps(attrib[12 + c]), specular[c]));
+			col = _mm256_min_ps(_mm256_max_ps(col, zero), _mm256_set1_ps(1.f));
+			__m256i byte = _mm256_cvttps_epi32(_mm256_mul_ps(col, _mm256_set1_ps(255.f)));
+			packed = _mm256_or_si256(packed, _mm256_slli_epi32(byte, 8 * c));
+		}
+		alignas(32) unsigned int out[8];
+		_mm256_store_si256((__m256i*)out, packed);
+		std::copy_n(out, n, color);
+	}
+#endif
+
+	//kd scaled by the diffuse map at the fragment
+	static Math::vec3 diffuseColor(const Fragment& f) {
+		return f.mtl->diffuseMap ? f.mtl->kd.cwiseProduct(f.mtl->diffuseMap->sample(f.uv, f.lod)) : f.mtl->kd;
+	}
 
 public:
-	FragmentShader(const Matirial& mtl, 
-		const Camera& camera, 
+	FragmentShader(const Camera& camera, 
 		const std::vector<Light>& light,
-		const Math::vec3& amb_light) :
-		mtl(mtl), camera(camera), light(light), amb_light(amb_light) {}
+		const Math::vec3& amb_light,
+		const LightClusters& clusters) :
+		camera(camera), light(light), amb_light(amb_light), clusters(clusters) {}
 
-	Math::vec3 run(Fragment& f) const {
+	Math::vec3 run(const Fragment& f) const {
+		const Matirial& mtl = *f.mtl;
+		Math::vec3 kd = diffuseColor(f);
 		Math::vec3 diffuse;
 		Math::vec3 specular;
-		Math::vec3 ambient;
+		Math::vec3 ambient = mtl.ka.cwiseProduct(amb_light);
 
 		Math::vec3 v = (camera.wPos - f.wPos).normalized();		//object to camera
-		for (auto& li : light) {
+		auto shade = [&](const Light& li) {
 			Math::vec3 l = li.wPos - f.wPos;			//object to lightsource
 
 			float r_2 = l.dot(l);
+			float fade = li.radius > 0 ? falloff(r_2, li.radius) : 1.f;
 			l = l.normalized();
 			Math::vec3 h = (l + v).normalized();//half
 
-			ambient = ambient + mtl.ka.cwiseProduct(amb_light);
-			diffuse = diffuse + mtl.kd.cwiseProduct(li.intensity) * (max(0.f, f.wNormal.dot(l)) / r_2);
-			specular = specular + mtl.ks.cwiseProduct(li.intensity) * (powf(max(0.f, f.wNormal.dot(h)), 300) / r_2);
-		}
+			diffuse = diffuse + kd.cwiseProduct(li.intensity) * (std::max(0.f, f.wNormal.dot(l)) / r_2 * fade);
+			specular = specular + mtl.ks.cwiseProduct(li.intensity) * (pown(std::max(0.f, f.wNormal.dot(h))) / r_2 * fade);
+			};
+		for (int i : clusters.globalLights()) shade(light[i]);
+		for (int i : clusterLights(&f, 1)) shade(light[i]);
 		return (diffuse + specular + ambient).clamped(0.f, 1.f, 0.f, 1.f);
 	}
+
+	//shade n fragments into packed colors, 8 at a time with AVX2
+	void run(const Fragment* f, int n, unsigned int* color) const {
+#if defined(__AVX2__)
+		for (int i = 0; i < n; i += 8) run8(f + i, std::min(n - i, 8), color + i);
+#else
+		for (int i = 0; i < n; i++) color[i] = Canvas::packColor(run(f[i]));
+#endif
+	}
 };
 
 class Renderer {
-	Math::mat4 M, invTransM, PV;
+	Math::mat4 PV;
+
+	//f(std::bool_constant<flag>...) for the runtime flags, so every combination is compiled as its own variant
+	//and the choice is made once instead of in the inner loops
+	template<class F>
+	static void dispatch(F&& f) { f(); }
+
+	template<class F, class... B>
+	static void dispatch(F&& f, bool flag, B... rest) {
+		auto bind = [&](auto c) { dispatch([&](auto... r) { f(c, r...); }, rest...); };
+		if (flag) bind(std::true_type{});
+		else bind(std::false_type{});
+	}
+
+	//models inside the frustum
+	struct Instance {
+		const Model* model;
+		Math::mat4 M, invTransM;
+		Math::vec4 frustum[6];		//model space planes, a point p is inside when every dot(plane, {p, 1}) >= 0
+		Math::vec3 mEye;			//model space camera position
+		const MeshLod* lod;
+	};
+	std::vector<Instance> instance;
 
-	//Ϣ
-	std::vector<Math::vec3> wPos;
-	std::vector<Math::vec4> cPos;
-	std::vector<Math::vec3> wNormal;
+	//clusters of every instance, after cullClusters only the visible ones, their triangles and vertices packed in order
+	struct DrawCluster {
+		int instance, cluster;
+		int first;					//first triangle in the frame
+		int vertexFirst;			//first vertex in wPos, cPos, wNormal and texCoord, a multiple of 8
+	};
+	std::vector<DrawCluster> drawCluster;
+	std::vector<unsigned char> clusterVisible;
+	int numTriangles = 0;
 
-	//Ϣ
+	//顶点信息，每个分量一个数组，顶点阶段一次写8个顶点
+	std::vector<float> wPos[3];
+	std::vector<float> cPos[4];
+	std::vector<float> wNormal[3];
+	std::vector<float> texCoord[2];
+
+	//像素信息
 	std::vector<float> depthBuf;
-	std::vector<Fragment> fragment;
+	std::vector<uint64_t> visBuf;		//visibility buffer, depth in the high 32 bits, triangle id in the low
+
+	//everything a frame is drawn from, the canvas keeps the last frame while none of it changes
+	struct FrameState {
+		const Canvas* canvas = nullptr;
+		int width = 0, height = 0;
+		uint64_t camera = 0;
+		std::vector<uint64_t> model;		//versions of the scene's models in order
+		std::vector<Light> light;
+		Math::vec3 amb_light;
+		Setting setting;
+
+		bool operator==(const FrameState&) const = default;
+	};
+	FrameState frameState, lastFrame;
+	bool reused = false;
+
+	//dynamic resolution, the frame is drawn into a smaller canvas and scaled up into the real one
+	static constexpr float minScale = 0.25f;
+	float scale = 1.f;							//side of the drawn frame / side of the canvas
+	std::unique_ptr<OffscreenCanvas> scaled;
 
 	//threads
 	int numThreads = std::thread::hardware_concurrency();
 	ThreadPool threads;
-	std::mutex mtx;
 
-	void updateMatrix(const Camera& camera, const Model& model) {
-		M = model.calcMatrixM();
-		invTransM = M.inverse().transpose();
+	//tile binning: setup batch b only appends to batchTriangle[b] and its own row of bins,
+	//the raster stage then gives every tile to exactly one task, so neither stage needs a lock
+	struct BinnedTriangle {
+		Triangle t;
+		float area;
+		const Matirial* mtl;
+		Math::vec3 texPlane[3];		//u/w, v/w and 1/w as { at ver[0], d/dx, d/dy } in screen space, with a diffuse map only
+	};
+
+	static constexpr int tileSize = 64;		//a multiple of Raster::blockSize, 8x8 blocks at most for the hierarchical z mask
+	int numBatches = 4 * numThreads;
+	std::vector<std::vector<Fragment>> tileFragment;			//fragments passing early z, per tile
+	std::vector<std::vector<std::pair<const BinnedTriangle*, uint64_t>>> tileWriter;	//triangles that wrote depth in the prepass and their 8x8 blocks, per tile
+
+	//everything the raster stage reads of a frame, pipelined the next frame is set up into the other one
+	//while this one is shaded, so it keeps copies of what the caller may change in between
+	struct Frame {
+		Canvas* canvas = nullptr;
+		Setting setting;
+		std::optional<Camera> camera;
+		std::vector<Light> light;
+		LightClusters lightClusters;
+		Math::vec3 amb_light;
+		std::vector<Matirial> material;							//of every instance, BinnedTriangle::mtl points here
+
+		int tilesX = 0, tilesY = 0;
+		std::vector<std::vector<BinnedTriangle>> batchTriangle;		//screen space triangles of each setup batch
+		std::vector<std::vector<int>> bin;							//[batch * tiles + tile], indices into batchTriangle[batch]
+	};
+	Frame frame[2];
+	int cur = 0;						//the frame set up next
+	bool pending = false;				//frame[cur ^ 1] is set up and waits to be shaded
+	ThreadPool::TaskGroup shading = 0;
+
+	//msaa samples only live while their tile is drawn, so every worker keeps one tile of them, 8x8 blocks in a row
+	struct TileSamples {
+		static constexpr int size = tileSize * tileSize * Raster::numSamples;
+		float depth[size];
+		int owner[size];			//the fragment of the tile that last passed the sample's depth test, -1 for none
+		unsigned int color[size];
+	};
+
+	static TileSamples& tileSamples() {
+		thread_local std::unique_ptr<TileSamples> scratch = std::make_unique<TileSamples>();
+		return *scratch;
+	}
+
+	void resizeTiles(Frame& f, const Canvas& canvas) {
+		f.tilesX = (canvas.width + tileSize - 1) / tileSize;
+		f.tilesY = (canvas.height + tileSize - 1) / tileSize;
+		f.batchTriangle.resize(numBatches);
+		f.bin.resize(numBatches * f.tilesX * f.tilesY);
+	}
+
+	//matrices and model space frustum of every model, the ones outside the frustum are dropped
+	void updateMatrix(const Canvas& canvas, const Camera& camera, const Scene& scene, const Setting& setting) {
 		PV = camera.calcMatrixP() * camera.calcMatrixV();
+
+		float pixels = 0.5f * canvas.height / tanf(camera.fov / 2.f);		//pixels of one unit at distance one
+
+		instance.clear();
+		for (auto& model : scene.model) {
+			auto& mesh = *model.mesh;
+			Instance inst;
+			inst.model = &model;
+			inst.M = model.calcMatrixM();
+			inst.invTransM = inst.M.inverse().transpose();
+
+			//clip space keeps w = view space z < 0, inside is |x| <= -w, |y| <= -w and zFar <= w <= zNear
+			Math::mat4 MVP = PV * inst.M;
+			auto row = [&MVP](int i) { return Math::vec4{ MVP[i][0], MVP[i][1], MVP[i][2], MVP[i][3] }; };
+			Math::vec4 x = row(0), y = row(1), w = row(3);
+			inst.frustum[0] = -w - x;
+			inst.frustum[1] = x - w;
+			inst.frustum[2] = -w - y;
+			inst.frustum[3] = y - w;
+			inst.frustum[4] = Math::vec4{ 0,0,0,camera.zNear } - w;
+			inst.frustum[5] = w - Math::vec4{ 0,0,0,camera.zFar };
+			for (auto& p : inst.frustum) p = p / sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+
+			Math::vec4 eye = inst.M.inverse() * Math::vec4{ camera.wPos[0], camera.wPos[1], camera.wPos[2], 1.f };
+			inst.mEye = { eye[0], eye[1], eye[2] };
+
+			if (!inFrustum(inst, mesh.bounds)) continue;
+
+			//the coarsest level whose error stays under setting.lodError pixels at the nearest point of the bounds
+			Math::vec3 d = mesh.bounds.center - inst.mEye;
+			float dist = sqrtf(d.dot(d)) - mesh.bounds.radius;
+			int level = 0;
+			while (level + 1 < mesh.lod.size() && dist > 0 && mesh.lod[level + 1].error * pixels <= setting.lodError * dist) level++;
+			inst.lod = &mesh.lod[level];
+
+			instance.push_back(inst);
+		}
+	}
+
+	//false if the bounding sphere or the box lies completely outside one frustum plane
+	static bool inFrustum(const Instance& inst, const Bounds& b) {
+		for (auto& p : inst.frustum) {
+			if (p[0] * b.center[0] + p[1] * b.center[1] + p[2] * b.center[2] + p[3] < -b.radius) return false;
+
+			float d = p[3];		//the box corner farthest along the plane normal
+			for (int k = 0; k < 3; k++) d += p[k] * (p[k] > 0 ? b.max[k] : b.min[k]);
+			if (d < 0) return false;
+		}
+		return true;
+	}
+
+	//true if every face of the cluster faces away from the camera, wherever it lies inside the bounding sphere
+	static bool backfacing(const Instance& inst, const Cluster& c) {
+		Math::vec3 d = c.bounds.center - inst.mEye;
+		return c.coneAxis.dot(d) >= c.coneCutoff * sqrtf(d.dot(d)) + c.bounds.radius;
 	}
 
-	void clear(Canvas& canvas) {
-		auto clearTask = [&](int st, int ed) {
+	//only the visibility buffer and the wireframe draw outside the tiles, the raster stage clears each tile itself
+	void clear(Canvas& canvas, const Setting& setting) {
+		unsigned int bg = Canvas::packColor(canvas.bgColor);
+		auto clearTask = [&, bg](int st, int ed) {		//runs after clear returned, bg by value
 			for (int y = st; y < ed; y++) {
 				for (int x = 0; x < canvas.width; x++) {
 					int pid = y * canvas.width + x;
-					canvas.drawPixel(pid, canvas.bgColor);
-					depthBuf[pid] = -1e8;
+					canvas.colorBuf[pid] = bg;
+					if (setting.visibilityBuffer) visBuf[pid] = ~0ull;
 				}
 			}
 			};
 
 		int num = canvas.height;
-		int blockSize = max(min(num / (4 * numThreads), 512), 1);
+		int blockSize = std::max(std::min(num / (4 * numThreads), 512), 1);
 
 		for (int i = 0; i < canvas.height; i += blockSize) {
-			threads.addTask(clearTask, i, min(i + blockSize, canvas.height));
+			threads.addTask(clearTask, i, std::min(i + blockSize, canvas.height));
 		}
-
-		fragment.clear();
 	}
 
-	void vertexProcess(const Model& model) {
-		wPos.resize(model.mesh.mPos.size());
-		cPos.resize(model.mesh.mPos.size());
-		wNormal.resize(model.mesh.mNormal.size());
-
-		auto vertexProcessTask1 = [&](int st, int ed) {
-			for (int id = st; id < ed; id++) {
-				auto& mPos = model.mesh.mPos[id];
-				Math::vec4 pos = { mPos[0],mPos[1],mPos[2],1.f };
-				pos = M * pos;
-				wPos[id] = Math::vec3{ pos[0], pos[1], pos[2] };
+	//drop the clusters outside the frustum or facing away, then pack the triangles and vertices of the rest
+	void cullClusters(const Setting& setting) {
+		drawCluster.clear();
+		for (int i = 0; i < instance.size(); i++) {
+			int num = instance[i].lod->cluster.size();
+			for (int c = 0; c < num; c++) drawCluster.push_back({ i, c, 0, 0 });
+		}
+		clusterVisible.resize(drawCluster.size());
+
+		int num = drawCluster.size();
+		int blockSize = std::max(std::min(512, num / (8 * numThreads)), 1);
+
+		dispatch([&](auto cull) {
+			auto cullTask = [&](int st, int ed) {
+				for (int i = st; i < ed; i++) {
+					auto& inst = instance[drawCluster[i].instance];
+					auto& cluster = inst.lod->cluster[drawCluster[i].cluster];
+					if constexpr (cull) clusterVisible[i] = inFrustum(inst, cluster.bounds) && !backfacing(inst, cluster);
+					else clusterVisible[i] = inFrustum(inst, cluster.bounds);
+				}
+				};
 
-				pos = PV * pos;
-				cPos[id] = pos;
+			for (int i = 0; i < num; i += blockSize) {
+				threads.addTask(cullTask, i, std::min(i + blockSize, num));
 			}
-			};
+			}, setting.backfaceCulling);
 
-		int num = model.mesh.mPos.size();
-		int blockSize = max(min(512, num / (8 * numThreads)), 1);
+		threads.barrier();
 
-		for (int i = 0; i < num; i += blockSize) {
-			threads.addTask(vertexProcessTask1, i, min(i + blockSize, num));
+		int visible = 0, vertices = 0;
+		numTriangles = 0;
+		for (int i = 0; i < num; i++) {
+			if (!clusterVisible[i]) continue;
+			auto& dc = drawCluster[visible++] = drawCluster[i];
+			auto& cluster = instance[dc.instance].lod->cluster[dc.cluster];
+			dc.first = numTriangles;
+			dc.vertexFirst = vertices;
+			numTriangles += cluster.count;
+			vertices += (cluster.vertexCount + 7) & ~7;		//whole groups of 8, so no two tasks store to the same group
 		}
+		drawCluster.resize(visible);
 
-		auto vertexProcessTask2 = [&](int st, int ed) {
-			for (int id = st; id < ed; id++) {
-				auto& mNormal = model.mesh.mNormal[id];
-				Math::vec4 normal = { mNormal[0],mNormal[1],mNormal[2],0.f };
-				normal = invTransM * normal;
-				wNormal[id] = { normal[0], normal[1], normal[2] };
+		for (auto* a : { wPos, wNormal }) {
+			for (int k = 0; k < 3; k++) a[k].resize(vertices);
+		}
+		for (auto& a : cPos) a.resize(vertices);
+		for (auto& a : texCoord) a.resize(vertices);
+	}
+
+	//the n vertices of a cluster from lod's arrays at src into the frame's at dst, positions to world and clip space
+	//and normals to world space in one pass, 8 at a time with AVX2, sums in the order of Math::mat4 * Math::vec4
+	void transformVertices(const Instance& inst, const MeshLod& lod, int src, int dst, int n) {
+#if defined(__AVX2__)
+		__m256 M[16], clip[16], N[12];
+		for (int i = 0; i < 16; i++) {
+			M[i] = _mm256_set1_ps(inst.M[i / 4][i % 4]);
+			clip[i] = _mm256_set1_ps(PV[i / 4][i % 4]);
+			if (i < 12) N[i] = _mm256_set1_ps(inst.invTransM[i / 4][i % 4]);
+		}
+		auto row = [](const __m256* m, const __m256 v[4]) {
+			__m256 sum = _mm256_setzero_ps();
+			for (int j = 0; j < 4; j++) sum = _mm256_add_ps(sum, _mm256_mul_ps(m[j], v[j]));
+			return sum;
+			};
+
+		const __m256 one = _mm256_set1_ps(1.f);
+		for (int k = 0; k < n; k += 8) {
+			__m256 p[4], w[4], nrm[4];
+			for (int c = 0; c < 3; c++) {
+				p[c] = _mm256_loadu_ps(&lod.vertexPos[c][src + k]);
+				nrm[c] = _mm256_loadu_ps(&lod.vertexNormal[c][src + k]);
+			}
+			p[3] = one;
+			nrm[3] = _mm256_setzero_ps();
+
+			for (int c = 0; c < 3; c++) w[c] = row(M + 4 * c, p);
+			w[3] = one;		//the last row of a model matrix is 0 0 0 1
+			for (int c = 0; c < 3; c++) {
+				_mm256_storeu_ps(&wPos[c][dst + k], w[c]);
+				_mm256_storeu_ps(&wNormal[c][dst + k], row(N + 4 * c, nrm));
+			}
+			for (int c = 0; c < 4; c++) _mm256_storeu_ps(&cPos[c][dst + k], row(clip + 4 * c, w));
+			for (int c = 0; c < 2; c++) _mm256_storeu_ps(&texCoord[c][dst + k], _mm256_loadu_ps(&lod.vertexUV[c][src + k]));
+		}
+#else
+		for (int k = 0; k < n; k++) {
+			Math::vec4 pos = { lod.vertexPos[0][src + k], lod.vertexPos[1][src + k], lod.vertexPos[2][src + k], 1.f };
+			pos = inst.M * pos;
+			Math::vec4 clipPos = PV * pos;
+			Math::vec4 normal = { lod.vertexNormal[0][src + k], lod.vertexNormal[1][src + k], lod.vertexNormal[2][src + k], 0.f };
+			normal = inst.invTransM * normal;
+			for (int c = 0; c < 3; c++) {
+				wPos[c][dst + k] = pos[c];
+				wNormal[c][dst + k] = normal[c];
+			}
+			for (int c = 0; c < 4; c++) cPos[c][dst + k] = clipPos[c];
+			for (int c = 0; c < 2; c++) texCoord[c][dst + k] = lod.vertexUV[c][src + k];
+		}
+#endif
+	}
+
+	void vertexProcess() {
+		auto vertexProcessTask = [&](int st, int ed) {
+			for (int i = st; i < ed; i++) {
+				auto& dc = drawCluster[i];
+				auto& inst = instance[dc.instance];
+				auto& cluster = inst.lod->cluster[dc.cluster];
+				transformVertices(inst, *inst.lod, cluster.vertexFirst, dc.vertexFirst, cluster.vertexCount);
 			}
 			};
 
-		num = model.mesh.mNormal.size();
-		blockSize = max(min(512, num / (8 * numThreads)), 1);
+		int num = drawCluster.size();
+		int blockSize = std::max(std::min(64, num / (8 * numThreads)), 1);
 
 		for (int i = 0; i < num; i += blockSize) {
-			threads.addTask(vertexProcessTask2, i, min(i + blockSize, num));
+			threads.addTask(vertexProcessTask, i, std::min(i + blockSize, num));
 		}
 
 		threads.barrier();
 	}
 
-	std::vector<Triangle> clipTriangle(Triangle& t, float vZPlane) {//clip triangles using the z plane of view space
-		bool out[3] = {
-			t.ver[0].cPos[3] >= vZPlane,
-			t.ver[1].cPos[3] >= vZPlane,
-			t.ver[2].cPos[3] >= vZPlane
-		};
+	//clip space planes { a, b, c, d }, a point is inside when a * x + b * y + c * w + d >= 0
+	//0-3 the sides of the frustum, 4 near, 5 far, 6-9 the guard band, where screen coordinates stay inside Raster::maxCoord
+	static constexpr int numClipPlanes = 10;
+	static constexpr int frustumPlanes = 0x3f, clipPlanes = 0x3f0;		//planes rejecting and planes clipping
+	static constexpr int maxClipVertices = 3 + 6;						//every clipping plane adds at most one vertex
+	Math::vec4 clipPlane[numClipPlanes];
+
+	void updateClipPlanes(const Canvas& canvas, const Camera& camera) {
+		float gx = Raster::maxCoord / canvas.width, gy = Raster::maxCoord / canvas.height;		//in ndc
+		clipPlane[0] = { 1, 0, -1, 0 };
+		clipPlane[1] = { -1, 0, -1, 0 };
+		clipPlane[2] = { 0, 1, -1, 0 };
+		clipPlane[3] = { 0, -1, -1, 0 };
+		clipPlane[4] = { 0, 0, -1, camera.zNear };
+		clipPlane[5] = { 0, 0, 1, -camera.zFar };
+		clipPlane[6] = { 1, 0, -gx, 0 };
+		clipPlane[7] = { -1, 0, -gx, 0 };
+		clipPlane[8] = { 0, 1, -gy, 0 };
+		clipPlane[9] = { 0, -1, -gy, 0 };
+	}
 
-		if (out[0] && out[1] && out[2])return{};
+	float clipDistance(const Math::vec4& cPos, int plane) const {
+		auto& p = clipPlane[plane];
+		return p[0] * cPos[0] + p[1] * cPos[1] + p[2] * cPos[3] + p[3];
+	}
 
-		if (!out[0] && !out[1] && !out[2]) return { t };
+	//clip t against the frustum, the triangle fan of what is left goes to out, returns the number of triangles
+	//x and y are only clipped at the guard band, the rasterizer and the screen bounds take care of the rest
+	int clipTriangle(const Triangle& t, Triangle out[maxClipVertices - 2]) const {
+		int code[3] = { 0, 0, 0 };
+		for (int i = 0; i < 3; i++) {
+			for (int p = 0; p < numClipPlanes; p++) code[i] |= (clipDistance(t.ver[i].cPos, p) < 0) << p;
+		}
+		if (code[0] & code[1] & code[2] & frustumPlanes) return 0;		//outside one plane
 
-		std::vector<Vertex> clipVertex;
-		for (int i = 0, j = 1; i < 3; i++, j = (j + 1) % 3) {
-			float da = vZPlane - t.ver[i].cPos[3];
-			float db = vZPlane - t.ver[j].cPos[3];
-
-			if (da * db < 0) {
-				//interpolate vertex arrtribute
-				float alpha = da / (da - db);
-				auto interpolate = [&alpha](auto& attribA, auto& attribB) {
-					return attribA * (1 - alpha) + attribB * alpha;
-					};
-
-				auto itp_wPos = interpolate(t.ver[i].wPos, t.ver[j].wPos);
-				auto itp_cPos = interpolate(t.ver[i].cPos, t.ver[j].cPos);
-				auto itp_wNormal = interpolate(t.ver[i].wNormal, t.ver[j].wNormal);
-				clipVertex.emplace_back(itp_wPos, itp_cPos, itp_wNormal);
+		int clip = (code[0] | code[1] | code[2]) & clipPlanes;
+		if (!clip) {
+			out[0] = t;
+			return 1;
+		}
+
+		//Sutherland-Hodgman on the stack
+		Vertex polygon[2][maxClipVertices];
+		int num = 3, cur = 0;
+		for (int i = 0; i < 3; i++) polygon[0][i] = t.ver[i];
+		for (int p = 0; p < numClipPlanes; p++) {
+			if (!(clip >> p & 1)) continue;
+
+			Vertex* src = polygon[cur], * dst = polygon[cur ^ 1];
+			int n = 0;
+			for (int i = 0, j = 1 % num; i < num; i++, j = (j + 1) % num) {
+				float da = clipDistance(src[i].cPos, p);
+				float db = clipDistance(src[j].cPos, p);
+
+				if (da * db < 0) {
+					//interpolate vertex arrtribute
+					float alpha = da / (da - db);
+					auto interpolate = [&alpha](auto& attribA, auto& attribB) {
+						return attribA * (1 - alpha) + attribB * alpha;
+						};
+
+					dst[n++] = Vertex(interpolate(src[i].wPos, src[j].wPos),
+						interpolate(src[i].cPos, src[j].cPos),
+						interpolate(src[i].wNormal, src[j].wNormal),
+						interpolate(src[i].uv, src[j].uv));
+				}
+				if (db >= 0) dst[n++] = src[j];
 			}
-			if (db > 0) clipVertex.emplace_back(t.ver[j].wPos, t.ver[j].cPos, t.ver[j].wNormal);
+			num = n;
+			cur ^= 1;
+			if (num < 3) return 0;
 		}
 
-		std::vector<Triangle> triangles;
-		for (int i = 2; i < clipVertex.size(); i++) {
-			triangles.emplace_back(Triangle{ clipVertex[0], clipVertex[i - 1], clipVertex[i] });
+		for (int i = 2; i < num; i++) {
+			out[i - 2] = Triangle{ polygon[cur][0], polygon[cur][i - 1], polygon[cur][i] };
 		}
-		return triangles;
+		return num - 2;
 	}
 
-	void setup_rasterize_triangle(Canvas& canvas, const Camera& camera, const Model& model, const Setting& setting) {
-		auto setup_rasterize_triangle_task = [&](int st, int ed) {
-			TempFragBuffer buf(fragment, depthBuf, mtx);
+	//one setup batch of frame f, a variant per culling, wireframe, visibility buffer and msaa
+	template<bool cull, bool framework, bool visibility, bool multisample>
+	void setup_bin_triangle_task(Frame& f, int batch) {
+		Canvas& canvas = *f.canvas;
+		int numTiles = f.tilesX * f.tilesY;
+		int num = numTriangles;
+		int batchSize = (num + numBatches - 1) / numBatches;
+
+		auto& triangle = f.batchTriangle[batch];
+		triangle.clear();
+		for (int tile = 0; tile < numTiles; tile++) f.bin[batch * numTiles + tile].clear();
+
+		int st = batch * batchSize, ed = std::min(st + batchSize, num);
+		int c = std::upper_bound(drawCluster.begin(), drawCluster.end(), st, [](int id, const DrawCluster& dc) { return id < dc.first; }) - drawCluster.begin() - 1;
+		const MeshLod* lod = nullptr;
+		const Cluster* cluster = nullptr;
+		for (int id = st; id < ed; id++) {
+			if (!cluster || id >= drawCluster[c].first + cluster->count) {
+				if (cluster) c++;
+				lod = instance[drawCluster[c].instance].lod;
+				cluster = &lod->cluster[drawCluster[c].cluster];
+			}
+			auto& dc = drawCluster[c];
+			auto& face = lod->clusterIndex[cluster->first + id - dc.first];
+
+			//1 construct triangle
+			Triangle t;
+			for (int j = 0; j < 3; j++) {
+				int v = dc.vertexFirst + face[j] - cluster->vertexFirst;
+				for (int c = 0; c < 3; c++) {
+					t.ver[j].wPos[c] = wPos[c][v];
+					t.ver[j].wNormal[c] = wNormal[c][v];
+				}
+				for (int c = 0; c < 4; c++) t.ver[j].cPos[c] = cPos[c][v];
+				for (int c = 0; c < 2; c++) t.ver[j].uv[c] = texCoord[c][v];
+			}
 
-			for (int id = st; id < ed; id++) {
-				auto& face = model.mesh.tInfo[id];
+			//2 clip origin triangle
+			Triangle clipped[maxClipVertices - 2];
+			int numClipped = clipTriangle(t, clipped);
 
-				//1 construct triangle
-				Triangle t;
-				for (int j = 0; j < 3; j++) {
-					t.ver[j].wPos = wPos[face[j][0]];
-					t.ver[j].cPos = cPos[face[j][0]];
-					t.ver[j].wNormal = wNormal[face[j][2]];
+			//3 apply perspective division and viewport transform to get screen space coord
+			for (int k = 0; k < numClipped; k++) {
+				auto& t = clipped[k];
+				for (int i = 0; i < 3; i++) {
+					t.ver[i].cPos[0] /= t.ver[i].cPos[3];
+					t.ver[i].cPos[1] /= t.ver[i].cPos[3];
+				}
+				for (int i = 0; i < 3; i++) {
+					t.ver[i].sPos[0] = 0.5f * canvas.width * (t.ver[i].cPos[0] + 1.f);
+					t.ver[i].sPos[1] = 0.5f * canvas.height * (t.ver[i].cPos[1] + 1.f);
 				}
 
-				//2 clip origin triangle
-				std::vector<Triangle> triangles = clipTriangle(t, camera.zNear);
+				float area = (t.ver[0].sPos[0] - t.ver[1].sPos[0]) * (t.ver[1].sPos[1] - t.ver[2].sPos[1]) -
+					(t.ver[1].sPos[0] - t.ver[2].sPos[0]) * (t.ver[0].sPos[1] - t.ver[1].sPos[1]);
 
-				//3 apply perspective division and viewport transform to get screen space coord
-				for (auto& t : triangles) {
-					for (int i = 0; i < 3; i++) {
-						t.ver[i].cPos[0] /= t.ver[i].cPos[3];
-						t.ver[i].cPos[1] /= t.ver[i].cPos[3];
-					}
-					for (int i = 0; i < 3; i++) {
-						t.ver[i].sPos[0] = 0.5f * canvas.width * (t.ver[i].cPos[0] + 1.f);
-						t.ver[i].sPos[1] = 0.5f * canvas.height * (t.ver[i].cPos[1] + 1.f);
-					}
+				if (cull && area < 0) continue;	//backface culling
+
+				if constexpr (framework) {
+					drawTriangleFrame(canvas, t);
+					continue;
+				}
+
+				//4 bin the triangle into every tile its bounding box touches
+				float xmin = std::min(std::min(t.ver[0].sPos[0], t.ver[1].sPos[0]), t.ver[2].sPos[0]);
+				float xmax = std::max(std::max(t.ver[0].sPos[0], t.ver[1].sPos[0]), t.ver[2].sPos[0]);
+				float ymin = std::min(std::min(t.ver[0].sPos[1], t.ver[1].sPos[1]), t.ver[2].sPos[1]);
+				float ymax = std::max(std::max(t.ver[0].sPos[1], t.ver[1].sPos[1]), t.ver[2].sPos[1]);
+				if constexpr (multisample) {		//samples sit off the pixel center, a triangle can cover some of a pixel past its box
+					constexpr float reach = (float)Raster::sampleReach / Raster::subPixel;
+					xmin -= reach, xmax += reach, ymin -= reach, ymax += reach;
+				}
+				if (xmax < 0 || ymax < 0 || xmin > canvas.width - 1.f || ymin > canvas.height - 1.f) continue;
+
+				int tx0 = (int)std::max(xmin, 0.f) / tileSize, tx1 = (int)std::min(xmax, canvas.width - 1.f) / tileSize;
+				int ty0 = (int)std::max(ymin, 0.f) / tileSize, ty1 = (int)std::min(ymax, canvas.height - 1.f) / tileSize;
 
-					float area = (t.ver[0].sPos[0] - t.ver[1].sPos[0]) * (t.ver[1].sPos[1] - t.ver[2].sPos[1]) -
-						(t.ver[1].sPos[0] - t.ver[2].sPos[0]) * (t.ver[0].sPos[1] - t.ver[1].sPos[1]);
+				int tid = triangle.size();
+				triangle.push_back({ t, area, &f.material[dc.instance] });
+				if (triangle.back().mtl->diffuseMap) texturePlanes(triangle.back());
 
-					if (setting.backfaceCulling && area < 0) continue;	//backface culling
+				if constexpr (visibility) {		//rasterize right away, the id encodes batch and index
+					uint32_t vid = (uint32_t)tid * numBatches + batch;
+					halfSpaceRasterize(t, area, 0, 0, canvas.width - 1, canvas.height - 1, [&](int x, int y, float alpha, float beta, float gama) {
+						visibilityWrite(y * canvas.width + x, interpolateDepth(t, alpha, beta, gama), vid);
+						});
+					continue;
+				}
 
-					if (setting.mod == Setting::Mod::framework) drawTriangleFrame(canvas, t);
-					else halfSpaceRasterize(canvas, t, area, buf);
+				for (int ty = ty0; ty <= ty1; ty++) {
+					for (int tx = tx0; tx <= tx1; tx++) {
+						f.bin[batch * numTiles + ty * f.tilesX + tx].push_back(tid);
+					}
 				}
 			}
+		}
+	}
+
+	void setup_bin_triangle(Frame& f, const Camera& camera, const Setting& setting) {
+		updateClipPlanes(*f.canvas, camera);
+
+		dispatch([&](auto cull, auto framework, auto visibility, auto multisample) {
+			auto setup_bin_triangle_task = [this, &f](int batch) {
+				this->setup_bin_triangle_task<decltype(cull)::value, decltype(framework)::value, decltype(visibility)::value, decltype(multisample)::value>(f, batch);
+				};
+			for (int batch = 0; batch < numBatches; batch++) {
+				threads.addTask(setup_bin_triangle_task, batch);
+			}
+			}, setting.backfaceCulling, setting.mod == Setting::Mod::framework, setting.visibilityBuffer, sampleCount(setting) > 1);
+
+		threads.barrier();
+	}
+
+	//perspective corrected depth from screen space weights
+	static float interpolateDepth(const Triangle& t, float alpha, float beta, float gama) {
+		return 1.f / (alpha / t.ver[0].cPos[3] + beta / t.ver[1].cPos[3] + gama / t.ver[2].cPos[3]);
+	}
+
+	//the planes textureLod reads, 1/w and the attributes over w are linear in screen space
+	static void texturePlanes(BinnedTriangle& bt) {
+		auto& t = bt.t;
+		float dx1 = t.ver[1].sPos[0] - t.ver[0].sPos[0], dy1 = t.ver[1].sPos[1] - t.ver[0].sPos[1];
+		float dx2 = t.ver[2].sPos[0] - t.ver[0].sPos[0], dy2 = t.ver[2].sPos[1] - t.ver[0].sPos[1];
+		for (int k = 0; k < 3; k++) {
+			float a[3];
+			for (int i = 0; i < 3; i++) a[i] = (k < 2 ? t.ver[i].uv[k] : 1.f) / t.ver[i].cPos[3];
+			float d1 = a[1] - a[0], d2 = a[2] - a[0];
+			bt.texPlane[k] = { a[0], (d1 * dy2 - d2 * dy1) / bt.area, (d2 * dx1 - d1 * dx2) / bt.area };
+		}
+	}
+
+	//mip level from the uv differences across the 2x2 quad of pixel (x, y), the same for all 4 pixels
+	static float textureLod(const BinnedTriangle& bt, int x, int y) {
+		float qx = (x & ~1) - bt.t.ver[0].sPos[0], qy = (y & ~1) - bt.t.ver[0].sPos[1];
+		auto uv = [&](float dx, float dy) {
+			float p[3];
+			for (int k = 0; k < 3; k++) p[k] = bt.texPlane[k][0] + bt.texPlane[k][1] * (qx + dx) + bt.texPlane[k][2] * (qy + dy);
+			return Math::vec2{ p[0] / p[2], p[1] / p[2] };
 			};
+		Math::vec2 origin = uv(0, 0);
+		return bt.mtl->diffuseMap->lod(uv(1, 0) - origin, uv(0, 1) - origin);
+	}
 
-		int num = model.mesh.tInfo.size();
-		int blockSize = max(min(512, num / (8 * numThreads)), 1);
+	static Fragment interpolateFragment(const BinnedTriangle& bt, int x, int y, int pid, float Z, float alpha, float beta, float gama) {
+		auto& t = bt.t;
+		float z0 = t.ver[0].cPos[3], z1 = t.ver[1].cPos[3], z2 = t.ver[2].cPos[3];
 
-		for (int i = 0; i < num; i += blockSize) {
-			threads.addTask(setup_rasterize_triangle_task, i, min(i + blockSize, num));
+		auto interpolate = [&](auto& attribA, auto& attribB, auto& attribC) {
+			return Z * (attribA * (alpha / z0) + attribB * (beta / z1) + attribC * (gama / z2));
+			};
+
+		Math::vec3 itp_worldPos = interpolate(t.ver[0].wPos, t.ver[1].wPos, t.ver[2].wPos);
+		Math::vec3 itp_worldNormal = interpolate(t.ver[0].wNormal, t.ver[1].wNormal, t.ver[2].wNormal);
+
+		Fragment f{ pid, Z, itp_worldPos, itp_worldNormal, bt.mtl, {}, 0.f };
+		if (bt.mtl->diffuseMap) {
+			f.uv = interpolate(t.ver[0].uv, t.ver[1].uv, t.ver[2].uv);
+			f.lod = textureLod(bt, x, y);
 		}
+		return f;
+	}
 
-		threads.barrier();
+	//screen space weights of pixel (x, y), false if the pixel is outside t
+	static bool barycentric(const Triangle& t, float area, int x, int y, float& alpha, float& beta, float& gama) {
+		float S[3];			//area of PAB PBC PCA ABC
+
+		for (int i = 0, j = 1; i < 3; i++, j = (j + 1) % 3) {
+			S[i] = (t.ver[j].sPos[0] - t.ver[i].sPos[0]) * (y - t.ver[i].sPos[1]) -
+				(t.ver[j].sPos[1] - t.ver[i].sPos[1]) * (x - t.ver[i].sPos[0]);
+			if (S[i] < 0) return false;
+		}
+
+		alpha = S[1] / area, beta = S[2] / area, gama = S[0] / area;
+		return true;
+	}
+
+	//the weights halfSpaceRasterize gave pixel (x, y)
+	static void pixelWeights(const Triangle& t, float area, int x, int y, float& alpha, float& beta, float& gama) {
+		float vx[3] = { t.ver[0].sPos[0], t.ver[1].sPos[0], t.ver[2].sPos[0] };
+		float vy[3] = { t.ver[0].sPos[1], t.ver[1].sPos[1], t.ver[2].sPos[1] };
+		if (!Raster::weights(vx, vy, x, y, alpha, beta, gama)) barycentric(t, area, x, y, alpha, beta, gama);
 	}
 
-	void halfSpaceRasterize(Canvas& canvas, Triangle& t, float area, TempFragBuffer& buf) {
+	//walk the pixels of t inside [x0, x1] x [y0, y1], calling frag(x, y, alpha, beta, gama) on covered ones
+	//or frag(x, y, mask, alpha, beta, gama) with the covered samples when multisample
+	//block(bx, by) returning false skips the 8x8 block at (bx, by)
+	template<bool multisample = false, class F, class B>
+	static void halfSpaceRasterize(const Triangle& t, float area, int x0, int y0, int x1, int y1, F&& frag, B&& block) {
+		float vx[3] = { t.ver[0].sPos[0], t.ver[1].sPos[0], t.ver[2].sPos[0] };
+		float vy[3] = { t.ver[0].sPos[1], t.ver[1].sPos[1], t.ver[2].sPos[1] };
+		if (Raster::rasterize<multisample>(vx, vy, x0, y0, x1, y1, frag, block)) return;
+
+		//vertices beyond the fixed point range, walk the bounding box in floating point
 		//bounding box
-		int lbound = min(max(min(min(t.ver[0].sPos[0], t.ver[1].sPos[0]), t.ver[2].sPos[0]), 0), canvas.width - 1);
-		int rbound = min(max(max(max(t.ver[0].sPos[0], t.ver[1].sPos[0]), t.ver[2].sPos[0]), 0), canvas.width - 1);
-		int bbound = min(max(min(min(t.ver[0].sPos[1], t.ver[1].sPos[1]), t.ver[2].sPos[1]), 0), canvas.height - 1);
-		int tbound = min(max(max(max(t.ver[0].sPos[1], t.ver[1].sPos[1]), t.ver[2].sPos[1]), 0), canvas.height - 1);
+		int lbound = std::min(std::max(std::min(std::min(t.ver[0].sPos[0], t.ver[1].sPos[0]), t.ver[2].sPos[0]), (float)x0), (float)x1);
+		int rbound = std::min(std::max(std::max(std::max(t.ver[0].sPos[0], t.ver[1].sPos[0]), t.ver[2].sPos[0]), (float)x0), (float)x1);
+		int bbound = std::min(std::max(std::min(std::min(t.ver[0].sPos[1], t.ver[1].sPos[1]), t.ver[2].sPos[1]), (float)y0), (float)y1);
+		int tbound = std::min(std::max(std::max(std::max(t.ver[0].sPos[1], t.ver[1].sPos[1]), t.ver[2].sPos[1]), (float)y0), (float)y1);
 		if (lbound > rbound)return;
 
 		for (int y = bbound; y <= tbound; y++) {
 			bool met = false;
 			for (int x = lbound; x <= rbound; x++) {
-				bool inside = true;
-				float S[3];			//area of PAB PBC PCA ABC
-
-				for (int i = 0, j = 1; i < 3; i++, j = (j + 1) % 3) {
-					S[i] = (t.ver[j].sPos[0] - t.ver[i].sPos[0]) * (y - t.ver[i].sPos[1]) -
-						(t.ver[j].sPos[1] - t.ver[i].sPos[1]) * (x - t.ver[i].sPos[0]);
-					if (S[i] < 0) {
-						inside = false;
-						break;
-					}
-				}
-
-				if (!inside) {
+				float alpha, beta, gama;
+				if (!barycentric(t, area, x, y, alpha, beta, gama)) {
 					if (met) break;
 					else continue;
 				}
 				met = true;
 
-				int pid = y * canvas.width + x;
-
-				//corrected interpolation 
-				float alpha = S[1] / area, beta = S[2] / area, gama = S[0] / area;
-				float z0 = t.ver[0].cPos[3], z1 = t.ver[1].cPos[3], z2 = t.ver[2].cPos[3];
-				float Z = 1.f / (alpha / z0 + beta / z1 + gama / z2);
-
-				auto interpolate = [&](auto& attribA, auto& attribB, auto& attribC) {
-					return Z * (attribA * (alpha / z0) + attribB * (beta / z1) + attribC * (gama / z2));
-					};
-
-				Math::vec3 itp_worldPos = interpolate(t.ver[0].wPos, t.ver[1].wPos, t.ver[2].wPos);
-				Math::vec3 itp_worldNormal = interpolate(t.ver[0].wNormal, t.ver[1].wNormal, t.ver[2].wNormal);
-
-				buf.push_back({ pid, Z, itp_worldPos, itp_worldNormal });
+				if constexpr (multisample) frag(x, y, (1 << Raster::numSamples) - 1, alpha, beta, gama);
+				else frag(x, y, alpha, beta, gama);
 			}
 		}
 	}
 
+	template<class F>
+	static void halfSpaceRasterize(const Triangle& t, float area, int x0, int y0, int x1, int y1, F&& frag) {
+		halfSpaceRasterize(t, area, x0, y0, x1, y1, frag, [](int, int) { return true; });
+	}
+
+	//nearer fragments have a larger (negative) view space Z, so the bits of -Z order like the depth
+	//and an atomic min on depth|id keeps the nearest triangle, ties going to the smaller id
+	void visibilityWrite(int pid, float Z, uint32_t vid) {
+		uint64_t key = (uint64_t)std::bit_cast<uint32_t>(-Z) << 32 | vid;
+		std::atomic_ref<uint64_t> ref(visBuf[pid]);
+		uint64_t old = ref.load(std::memory_order_relaxed);
+		while (key < old && !ref.compare_exchange_weak(old, key, std::memory_order_relaxed));
+	}
+
 	void drawTriangleFrame(Canvas& canvas, const Triangle& t) {
 		auto st0 = t.ver[0].sPos, st1 = t.ver[1].sPos, st2 = t.ver[2].sPos;
 		auto ed0 = t.ver[1].sPos, ed1 = t.ver[2].sPos, ed2 = t.ver[0].sPos;
@@ -342,75 +979,562 @@ class Renderer {
 			canvas.Bresenham(st2[0], st2[1], ed2[0], ed2[1]);
 	}
 
-	void fragmentProcess(Canvas& canvas, const FragmentShader& fragmentShader, const Setting& setting) {
-		std::function<void(int, int)> fragmentShadingTask;
-		if (setting.mod == Setting::Mod::PhongShading) {
-			fragmentShadingTask = [&](int st, int ed) {
-				for (int id = st; id < ed; id++) {
-					auto& f = fragment[id];
-					if (f.depth == depthBuf[f.pid]) {
-						canvas.drawPixel(f.pid, fragmentShader.run(f));
+	//collects fragments for the packet shader, out(tag, color) gets the packed color of every fragment pushed with tag
+	//depthColor colors by depth instead, right away
+	template<bool depthColor, class Out>
+	class ShadeQueue {
+		static constexpr int size = 8;
+		const FragmentShader& fragmentShader;
+		Out out;
+		Fragment fragment[size];
+		int tag[size];
+		int num = 0;
+
+	public:
+		ShadeQueue(const FragmentShader& fragmentShader, std::bool_constant<depthColor>, Out out) :
+			fragmentShader(fragmentShader), out(out) {}
+
+		void push(const Fragment& f, int t) {
+			if constexpr (depthColor) {
+				Math::vec3 color = { f.depth, f.depth, f.depth };
+				out(t, Canvas::packColor(color.clamped(-4, 0, 0, 1)));
+				return;
+			}
+			fragment[num] = f;
+			tag[num++] = t;
+			if (num == size) flush();
+		}
+
+		void flush() {
+			unsigned int color[size];
+			fragmentShader.run(fragment, num, color);
+			for (int i = 0; i < num; i++) out(tag[i], color[i]);
+			num = 0;
+		}
+	};
+
+	static int sampleCount(const Setting& setting) {
+		return setting.msaa && !setting.visibilityBuffer ? Raster::numSamples : 1;
+	}
+
+	//one tile of frame f, a variant per sample count, prepass and depth coloring
+	template<int samples, bool prepass, bool depthColor>
+	void rasterize_shade_tile_task(Frame& f, int tile) {
+		Canvas& canvas = *f.canvas;
+		FragmentShader fragmentShader(*f.camera, f.light, f.amb_light, f.lightClusters);
+		int numTiles = f.tilesX * f.tilesY;
+
+		int x0 = tile % f.tilesX * tileSize, y0 = tile / f.tilesX * tileSize;
+		int x1 = std::min(x0 + tileSize, canvas.width) - 1, y1 = std::min(y0 + tileSize, canvas.height) - 1;
+
+		//0 clear the tile, msaa clears its samples when a triangle reaches them
+		unsigned int bg = Canvas::packColor(canvas.bgColor);
+		for (int y = y0; y <= y1; y++) {
+			std::fill(canvas.colorBuf + y * canvas.width + x0, canvas.colorBuf + y * canvas.width + x1 + 1, bg);
+			if constexpr (samples == 1) std::fill(depthBuf.begin() + y * canvas.width + x0, depthBuf.begin() + y * canvas.width + x1 + 1, -1e8f);
+		}
+
+		//hierarchical z, the farthest depth of every 8x8 block and of the whole tile
+		//a triangle or block whose nearest depth is not in front of it cannot pass the depth test
+		//hizCount tracks how many samples (blocks) sit at that farthest depth, so a block is only
+		//rescanned after a triangle overwrote its last farthest sample
+		constexpr int hizSize = tileSize / Raster::blockSize;
+		float hizBlock[hizSize * hizSize];
+		int hizCount[hizSize * hizSize];
+		float hizTile = -1e8f;
+		int hizTileCount = 0;
+
+		auto blockRect = [&](int i, int& bx0, int& by0, int& bx1, int& by1) {
+			bx0 = x0 + i % hizSize * Raster::blockSize, by0 = y0 + i / hizSize * Raster::blockSize;
+			bx1 = std::min(bx0 + Raster::blockSize - 1, x1), by1 = std::min(by0 + Raster::blockSize - 1, y1);
+			};
+		for (int i = 0; i < hizSize * hizSize; i++) {
+			int bx0, by0, bx1, by1;
+			blockRect(i, bx0, by0, bx1, by1);
+			bool inside = bx0 <= x1 && by0 <= y1;
+			hizBlock[i] = inside ? -1e8f : FLT_MAX;
+			hizCount[i] = inside ? (bx1 - bx0 + 1) * (by1 - by0 + 1) * samples : 0;
+			hizTileCount += inside;
+		}
+
+		auto hizId = [&](int x, int y) {
+			return (y - y0) / Raster::blockSize * hizSize + (x - x0) / Raster::blockSize;
+			};
+
+		//msaa samples of a block are cleared when a triangle first reaches it
+		TileSamples* ts = samples > 1 ? &tileSamples() : nullptr;
+		uint64_t touched = 0;
+		auto sampleId = [&](int x, int y) {
+			const int span = Raster::blockSize - 1;
+			return ((hizId(x, y) * Raster::blockSize + (y & span)) * Raster::blockSize + (x & span)) * samples;
+			};
+
+		auto hizRefresh = [&](int i) {
+			int bx0, by0, bx1, by1;
+			blockRect(i, bx0, by0, bx1, by1);
+			float old = hizBlock[i];
+			auto row = [&](int y) { return samples == 1 ? &depthBuf[y * canvas.width + bx0] : &ts->depth[sampleId(bx0, y)]; };
+			int n = (bx1 - bx0 + 1) * samples;		//the samples of a block row are contiguous
+			float farthest = FLT_MAX;
+			for (int y = by0; y <= by1; y++) {
+				const float* d = row(y);
+				for (int k = 0; k < n; k++) farthest = std::min(farthest, d[k]);
+			}
+			int count = 0;
+			for (int y = by0; y <= by1; y++) {
+				const float* d = row(y);
+				for (int k = 0; k < n; k++) count += d[k] == farthest;
+			}
+			hizBlock[i] = farthest, hizCount[i] = count;
+			if (old != hizTile || --hizTileCount) return;
+
+			hizTile = FLT_MAX;
+			for (int j = 0; j < hizSize * hizSize; j++) {
+				if (hizBlock[j] < hizTile) hizTile = hizBlock[j], hizTileCount = 0;
+				hizTileCount += hizBlock[j] == hizTile;
+			}
+			};
+
+		//1 rasterize the tile's triangles in submission order, with the prepass depth is all they write
+		auto& fragment = tileFragment[tile];
+		auto& writer = tileWriter[tile];
+		fragment.clear();
+		writer.clear();
+		for (int batch = 0; batch < numBatches; batch++) {
+			auto& triangle = f.batchTriangle[batch];
+			for (int tid : f.bin[batch * numTiles + tile]) {
+				auto& t = triangle[tid].t;
+				float zNearest = std::max(std::max(t.ver[0].cPos[3], t.ver[1].cPos[3]), t.ver[2].cPos[3]);
+				if (zNearest <= hizTile) continue;
+
+				uint64_t dirty = 0;
+				uint64_t wrote = 0;
+				auto block = [&](int bx, int by) { return zNearest > hizBlock[hizId(bx, by)]; };
+				if constexpr (samples == 1) {
+					halfSpaceRasterize(t, triangle[tid].area, x0, y0, x1, y1, [&](int x, int y, float alpha, float beta, float gama) {
+						int pid = y * canvas.width + x;
+						float Z = interpolateDepth(t, alpha, beta, gama);
+						if (Z <= depthBuf[pid]) return;		//earlyZ, the tile is owned by this task
+
+						int i = hizId(x, y);
+						if (depthBuf[pid] == hizBlock[i] && !--hizCount[i]) dirty |= 1ull << i;
+						depthBuf[pid] = Z;
+						wrote |= 1ull << i;
+
+						if constexpr (!prepass) fragment.push_back(interpolateFragment(triangle[tid], x, y, pid, Z, alpha, beta, gama));
+						}, block);
+					if (prepass && wrote) writer.push_back({ &triangle[tid], wrote });
+				}
+				else {
+					//1/Z is linear in screen space, step it from the pixel to each sample
+					float invZ[3] = { 1.f / t.ver[0].cPos[3], 1.f / t.ver[1].cPos[3], 1.f / t.ver[2].cPos[3] };
+					float dx1 = t.ver[1].sPos[0] - t.ver[0].sPos[0], dy1 = t.ver[1].sPos[1] - t.ver[0].sPos[1];
+					float dx2 = t.ver[2].sPos[0] - t.ver[0].sPos[0], dy2 = t.ver[2].sPos[1] - t.ver[0].sPos[1];
+					float di1 = invZ[1] - invZ[0], di2 = invZ[2] - invZ[0];
+					float gx = (di1 * dy2 - di2 * dy1) / triangle[tid].area, gy = (di2 * dx1 - di1 * dx2) / triangle[tid].area;
+					float sampleStep[Raster::numSamples];
+					for (int s = 0; s < Raster::numSamples; s++) {
+						sampleStep[s] = (gx * Raster::sampleX[s] + gy * Raster::sampleY[s]) / Raster::subPixel;
 					}
+
+					halfSpaceRasterize<true>(t, triangle[tid].area, x0, y0, x1, y1, [&](int x, int y, int mask, float alpha, float beta, float gama) {
+						int i = hizId(x, y);
+						if (!(touched >> i & 1)) {
+							touched |= 1ull << i;
+							int first = i * Raster::blockSize * Raster::blockSize * samples;
+							std::fill_n(ts->depth + first, Raster::blockSize * Raster::blockSize * samples, -1e8f);
+							std::fill_n(ts->owner + first, Raster::blockSize * Raster::blockSize * samples, -1);
+						}
+
+						//the weights are at the pixel or, on an edge, at its first covered sample
+						const int full = (1 << Raster::numSamples) - 1;
+						float weightInvZ = alpha * invZ[0] + beta * invZ[1] + gama * invZ[2];
+						float pixelInvZ = mask == full ? weightInvZ : weightInvZ - sampleStep[std::countr_zero((unsigned)mask)];
+
+						float Z[Raster::numSamples];		//all at once, a single vector division
+						for (int s = 0; s < Raster::numSamples; s++) Z[s] = 1.f / (pixelInvZ + sampleStep[s]);
+
+						int pid = y * canvas.width + x, first = sampleId(x, y);
+						bool passed = false;
+						for (; mask; mask &= mask - 1) {
+							int s = std::countr_zero((unsigned)mask);
+							if (Z[s] <= ts->depth[first + s]) continue;
+
+							if (ts->depth[first + s] == hizBlock[i] && !--hizCount[i]) dirty |= 1ull << i;
+							ts->depth[first + s] = Z[s];
+							ts->owner[first + s] = fragment.size();
+							passed = true;
+						}
+
+						if (passed) fragment.push_back(interpolateFragment(triangle[tid], x, y, pid, 1.f / weightInvZ, alpha, beta, gama));
+						}, block);
 				}
-				};
+
+				while (dirty) {
+					hizRefresh(std::countr_zero(dirty));
+					dirty &= dirty - 1;
+				}
+			}
+		}
+
+		//2 shade the fragments that are still visible
+		auto drawPixel = [&](int pid, unsigned int color) { canvas.colorBuf[pid] = color; };
+		if constexpr (prepass) {
+			ShadeQueue shade(fragmentShader, std::bool_constant<depthColor>{}, drawPixel);
+			//the depth is final, a triangle can only own pixels of the blocks it wrote depth to, a pixel is interpolated by
+			//the first triangle in order reaching it again and marked done, the same one the depth test kept without the prepass
+			for (auto [bt, blocks] : writer) {
+				auto& t = bt->t;
+				halfSpaceRasterize(t, bt->area, x0, y0, x1, y1, [&](int x, int y, float alpha, float beta, float gama) {
+					int pid = y * canvas.width + x;
+					float Z = interpolateDepth(t, alpha, beta, gama);
+					if (Z != depthBuf[pid]) return;
+					depthBuf[pid] = FLT_MAX;
+
+					shade.push(interpolateFragment(*bt, x, y, pid, Z, alpha, beta, gama), pid);
+					}, [&](int bx, int by) { return blocks >> hizId(bx, by) & 1; });
+			}
+			shade.flush();
+			return;
+		}
+		else if constexpr (samples == 1) {
+			ShadeQueue shade(fragmentShader, std::bool_constant<depthColor>{}, drawPixel);
+			for (auto& f : fragment) {
+				if (f.depth == depthBuf[f.pid]) shade.push(f, f.pid);
+			}
+			shade.flush();
+			return;
 		}
-		else if (setting.mod == Setting::Mod::zColoring) {
-			fragmentShadingTask = [&](int st, int ed) {
-				for (int id = st; id < ed; id++) {
-					auto& f = fragment[id];
-					if (f.depth == depthBuf[f.pid]) {
-						Math::vec3 color = { depthBuf[f.pid], depthBuf[f.pid], depthBuf[f.pid] };
-						canvas.drawPixel(f.pid, color.clamped(-4, 0, 0, 1));
+
+		//with msaa once for all the samples a fragment still owns
+		auto liveSamples = [&](int k, int& first) {
+			first = sampleId(fragment[k].pid % canvas.width, fragment[k].pid / canvas.width);
+			int live = 0;
+			for (int s = 0; s < samples; s++) live |= (ts->owner[first + s] == k) << s;
+			return live;
+			};
+		ShadeQueue shade(fragmentShader, std::bool_constant<depthColor>{}, [&](int k, unsigned int color) {
+			int first;
+			for (int live = liveSamples(k, first); live; live &= live - 1) ts->color[first + std::countr_zero((unsigned)live)] = color;
+			});
+		for (int k = 0; k < fragment.size(); k++) {
+			int first;
+			if (liveSamples(k, first)) shade.push(fragment[k], k);
+		}
+		shade.flush();
+
+		//3 average the samples of the blocks drawn to, the others keep the background
+		for (; touched; touched &= touched - 1) {
+			int bx0, by0, bx1, by1;
+			blockRect(std::countr_zero(touched), bx0, by0, bx1, by1);
+			for (int y = by0; y <= by1; y++) {
+				for (int x = bx0; x <= bx1; x++) {
+					int first = sampleId(x, y);
+					if (ts->owner[first] >= 0 && std::count(ts->owner + first, ts->owner + first + samples, ts->owner[first]) == samples) {
+						canvas.colorBuf[y * canvas.width + x] = ts->color[first];		//inside one fragment
+						continue;
+					}
+					unsigned int r = 0, g = 0, b = 0;
+					for (int s = 0; s < samples; s++) {
+						unsigned int c = ts->owner[first + s] < 0 ? bg : ts->color[first + s];
+						r += c & 0xff, g += c >> 8 & 0xff, b += c >> 16 & 0xff;
+					}
+					canvas.colorBuf[y * canvas.width + x] = (r + samples / 2) / samples | (g + samples / 2) / samples << 8 | (b + samples / 2) / samples << 16;
+				}
+			}
+		}
+	}
+
+	//draw frame f tile by tile, given a group the tasks are only queued to it and the caller waits for them
+	void rasterize_shade_tile(Frame& f, ThreadPool::TaskGroup* group = nullptr) {
+		Canvas& canvas = *f.canvas;
+		int numTiles = f.tilesX * f.tilesY;
+		int samples = sampleCount(f.setting);
+		if (samples == 1) depthBuf.resize(canvas.width * canvas.height);
+		tileFragment.resize(numTiles);
+		tileWriter.resize(numTiles);
+
+		//outlives the call, so only the frame, the renderer and the variant are captured
+		using Variant = void (Renderer::*)(Frame&, int);
+		Variant variant = nullptr;
+		dispatch([&](auto msaa, auto prepass, auto depthColor) {
+			constexpr int samples = decltype(msaa)::value ? Raster::numSamples : 1;
+			variant = &Renderer::rasterize_shade_tile_task<samples, decltype(prepass)::value && samples == 1, decltype(depthColor)::value>;
+			}, samples > 1, f.setting.zPrepass, f.setting.mod == Setting::Mod::zColoring);
+		auto rasterize_shade_tile_task = [this, &f, variant](int tile) { (this->*variant)(f, tile); };
+
+		for (int tile = 0; tile < numTiles; tile++) {
+			if (group) threads.addGroupTask(*group, rasterize_shade_tile_task, tile);
+			else threads.addTask(rasterize_shade_tile_task, tile);
+		}
+
+		if (!group) threads.barrier();
+	}
+
+	//shade every covered pixel once from the triangle id left in the visibility buffer
+	void resolveVisibility(Frame& f) {
+		Canvas& canvas = *f.canvas;
+		FragmentShader fragmentShader(*f.camera, f.light, f.amb_light, f.lightClusters);
+		int num = canvas.height;
+		int blockSize = std::max(std::min(num / (4 * numThreads), 512), 1);
+
+		dispatch([&](auto depthColor) {
+			auto resolveTask = [&](int st, int ed) {
+				ShadeQueue shade(fragmentShader, depthColor, [&](int pid, unsigned int color) { canvas.colorBuf[pid] = color; });
+				for (int y = st; y < ed; y++) {
+					for (int x = 0; x < canvas.width; x++) {
+						int pid = y * canvas.width + x;
+						uint64_t key = visBuf[pid];
+						if (key == ~0ull) continue;
+
+						uint32_t vid = (uint32_t)key;
+						auto& bt = f.batchTriangle[vid % numBatches][vid / numBatches];
+						float alpha = 0, beta = 0, gama = 0;
+						pixelWeights(bt.t, bt.area, x, y, alpha, beta, gama);
+						float Z = -std::bit_cast<float>((uint32_t)(key >> 32));
+
+						shade.push(interpolateFragment(bt, x, y, pid, Z, alpha, beta, gama), pid);
 					}
 				}
+				shade.flush();
 				};
+
+			for (int i = 0; i < canvas.height; i += blockSize) {
+				threads.addTask(resolveTask, i, std::min(i + blockSize, canvas.height));
+			}
+			}, f.setting.mod == Setting::Mod::zColoring);
+
+		threads.barrier();
+	}
+
+	//the canvas to draw the frame into at the current scale
+	Canvas& renderTarget(Canvas& canvas, const Setting& setting) {
+		if (setting.frameBudget <= 0) scale = 1.f;
+		if (scale >= 1.f) return canvas;
+
+		int w = std::max((int)(canvas.width * scale + 0.5f), 1), h = std::max((int)(canvas.height * scale + 0.5f), 1);
+		if (!scaled || scaled->width != w || scaled->height != h) {
+			scaled = std::make_unique<OffscreenCanvas>(w, h, canvas.bgColor, canvas.textColor);
 		}
+		return *scaled;
+	}
+
+	//pick the scale whose pixel stages fit in what the geometry leaves of the budget, assuming they cost per pixel
+	void updateScale(const Setting& setting, float geometryMs, float pixelMs) {
+		if (setting.frameBudget <= 0) return;
 
-		int num = fragment.size();
-		int blockSize = max(min(512, num / (8 * numThreads)), 1);
+		float perArea = pixelMs / (scale * scale);
+		float target = perArea > 0 ? sqrtf(std::max(setting.frameBudget - geometryMs, 0.f) / perArea) : 1.f;
+		target = std::min(std::max(target, minScale), 1.f);
 
-		for (int i = 0; i < fragment.size(); i += blockSize) {
-			threads.addTask(fragmentShadingTask, i, (int)min(i + blockSize, fragment.size()));
+		//go half way and in 1/32 steps, so timing noise does not resize the frame every time
+		scale = std::round((scale + (target - scale) * 0.5f) * 32.f) / 32.f;
+		scale = std::min(std::max(scale, minScale), 1.f);
+	}
+
+	//source texel and weight of every output column, the same for all rows
+	std::vector<int> upscaleX;
+	std::vector<unsigned int> upscaleW;
+
+	//bilinear, pixel centers of both canvases line up
+	void upscale(const Canvas& src, Canvas& dst) {
+		float sx = (float)src.width / dst.width, sy = (float)src.height / dst.height;
+
+		upscaleX.resize(dst.width);
+		upscaleW.resize(dst.width);
+		for (int x = 0; x < dst.width; x++) {
+			float fx = std::max((x + 0.5f) * sx - 0.5f, 0.f);
+			upscaleX[x] = std::min((int)fx, src.width - 1);
+			upscaleW[x] = upscaleX[x] + 1 < src.width ? (unsigned int)((fx - upscaleX[x]) * 256) : 0;
+		}
+
+		//0x00bbggrr lerped two channels at a time, each has 8 bits of room above it
+		auto lerp = [](unsigned int a, unsigned int b, unsigned int w) {
+			unsigned int rb = ((a & 0xff00ff) * (256 - w) + (b & 0xff00ff) * w) >> 8 & 0xff00ff;
+			unsigned int g = ((a & 0x00ff00) * (256 - w) + (b & 0x00ff00) * w) >> 8 & 0x00ff00;
+			return rb | g;
+			};
+
+		const int* tx = upscaleX.data();
+		const unsigned int* tw = upscaleW.data();
+		int width = dst.width;
+		auto upscaleTask = [&](int st, int ed) {
+			std::vector<unsigned int> row(src.width + 1);		//the two source rows blended, repeating the last texel
+			for (int y = st; y < ed; y++) {
+				float fy = std::max((y + 0.5f) * sy - 0.5f, 0.f);
+				int y0 = std::min((int)fy, src.height - 1), y1 = std::min(y0 + 1, src.height - 1);
+				unsigned int wy = (unsigned int)((fy - y0) * 256);
+				const unsigned int* row0 = src.colorBuf + y0 * src.width, * row1 = src.colorBuf + y1 * src.width;
+				for (int x = 0; x < src.width; x++) row[x] = lerp(row0[x], row1[x], wy);
+				row[src.width] = row[src.width - 1];
+
+				unsigned int* out = dst.colorBuf + y * dst.width;
+				const unsigned int* blended = row.data();
+				for (int x = 0; x < width; x++) out[x] = lerp(blended[tx[x]], blended[tx[x] + 1], tw[x]);
+			}
+			};
+
+		int num = dst.height;
+		int blockSize = std::max(std::min(num / (4 * numThreads), 512), 1);
+
+		for (int i = 0; i < dst.height; i += blockSize) {
+			threads.addTask(upscaleTask, i, std::min(i + blockSize, dst.height));
 		}
 
 		threads.barrier();
 	}
 
+	//true if the frame would come out exactly as the last one
+	bool unchanged(const Canvas& canvas, const Camera& camera, const Setting& setting, const Scene& scene,
+		const std::vector<Light>& light, const Math::vec3& amb_light) {
+		frameState.canvas = &canvas;
+		frameState.width = canvas.width;
+		frameState.height = canvas.height;
+		frameState.camera = camera.version;
+		frameState.model.clear();
+		for (auto& model : scene.model) frameState.model.push_back(model.version);
+		frameState.light = light;
+		frameState.amb_light = amb_light;
+		frameState.setting = setting;
+
+		if (frameState == lastFrame) return true;
+		std::swap(frameState, lastFrame);
+		return false;
+	}
+
+	//steps up to binning, all the raster stage needs of the frame ends up in f
+	void prepare(Frame& f,
+		Canvas& canvas,
+		const Camera& camera,
+		const Setting& setting,
+		const Scene& scene,
+		const std::vector<Light>& light,
+		const Math::vec3& amb_light)
+	{
+		f.canvas = &canvas;
+		f.setting = setting;
+		f.camera.emplace(camera);
+		f.light = light;
+		f.amb_light = amb_light;
+		f.lightClusters.build(camera.calcMatrixV(), camera.calcMatrixP(), -camera.zNear, -camera.zFar, light, canvas.width, canvas.height);
+		resizeTiles(f, canvas);
+
+		//2.更新矩阵
+		updateMatrix(canvas, camera, scene, setting);
+		f.material.clear();
+		for (auto& inst : instance) {		//a material without its own diffuse map takes the mesh's
+			f.material.push_back(inst.model->mtl);
+			if (!f.material.back().diffuseMap) f.material.back().diffuseMap = inst.model->mesh->diffuseMap;
+		}
+
+		//3.剔除视锥外的模型、背向的meshlet，顶点变换
+		if (instance.empty()) {
+			for (auto& triangle : f.batchTriangle) triangle.clear();
+			for (auto& b : f.bin) b.clear();
+			return;
+		}
+		cullClusters(setting);
+		vertexProcess();
+
+		//4.组装三角形并分块
+		setup_bin_triangle(f, camera, setting);
+	}
+
+	//draw the frame into canvas, returns when the per-pixel stages began
+	std::chrono::steady_clock::time_point render(Canvas& canvas,
+		const Camera& camera,
+		const Setting& setting,
+		const Scene& scene,
+		const std::vector<Light>& light,
+		const Math::vec3& amb_light)
+	{
+		//1.清空缓冲，逐块光栅化时每块自己清空
+		if (setting.visibilityBuffer) visBuf.resize(canvas.width * canvas.height);
+		if (setting.visibilityBuffer || setting.mod == Setting::Mod::framework) clear(canvas, setting);
+
+		Frame& f = frame[cur];
+		prepare(f, canvas, camera, setting, scene, light, amb_light);
+		threads.barrier();		//without instances nothing waited for the clear
+
+		//5.逐块光栅化、渲染像素
+		auto pixelStart = std::chrono::steady_clock::now();
+		if (setting.mod == Setting::Mod::framework) return pixelStart;
+		if (setting.visibilityBuffer) resolveVisibility(f);
+		else rasterize_shade_tile(f);
+		return pixelStart;
+	}
+
+	//the visibility buffer and the wireframe draw into the canvas during setup, dynamic resolution times every frame alone
+	static bool canPipeline(const Setting& setting) {
+		return setting.pipelined && !setting.visibilityBuffer && setting.mod != Setting::Mod::framework && setting.frameBudget <= 0;
+	}
+
 public:
 	Renderer() :threads(numThreads) {}
 
 	void draw(Canvas& canvas,
 		const Camera& camera, 
 		const Setting& setting,
-		const Model& model,
+		const Scene& scene,
 		const std::vector<Light>& light,
 		const Math::vec3& amb_light) 
 	{
-		//1.ջ
-		depthBuf.resize(canvas.width * canvas.height);
-		clear(canvas);
+		//0.相机、模型、光源和设置都没变时沿用上一帧，流水线里等着的那帧就是这一帧
+		reused = unchanged(canvas, camera, setting, scene, light, amb_light);
+		if (reused) {
+			reused = !pending;
+			finish();
+			return;
+		}
 
-		//2.¾
-		updateMatrix(camera, model);
+		//流水线：上一帧逐块着色的同时准备这一帧，画布晚一帧
+		if (canPipeline(setting)) {
+			scale = 1.f;
+			if (pending) rasterize_shade_tile(frame[cur ^ 1], &shading);
+			prepare(frame[cur], canvas, camera, setting, scene, light, amb_light);
+			threads.wait(shading);
+			pending = true;
+			cur ^= 1;
+			return;
+		}
+		finish();
+
+		//动态分辨率：按上一帧各阶段耗时选择绘制分辨率，最后放大到画布
+		auto start = std::chrono::steady_clock::now();
+		Canvas& target = renderTarget(canvas, setting);
+		auto pixelStart = render(target, camera, setting, scene, light, amb_light);
+		auto pixelEnd = std::chrono::steady_clock::now();
+		if (&target != &canvas) upscale(target, canvas);
+
+		//the upscale costs the same at every scale, it counts with the geometry
+		auto ms = [](auto d) { return std::chrono::duration<float, std::milli>(d).count(); };
+		updateScale(setting, ms(pixelStart - start) + ms(std::chrono::steady_clock::now() - pixelEnd), ms(pixelEnd - pixelStart));
+	}
 
-		//3.任
-		vertexProcess(model);
+	//shade the frame still waiting in the pipeline into its canvas
+	void finish() {
+		if (!pending) return;
+		rasterize_shade_tile(frame[cur ^ 1]);
+		pending = false;
+	}
 
-		//4.װդ
-		setup_rasterize_triangle(canvas, camera, model, setting);
+	//true if the last draw left the canvas alone because nothing changed
+	bool frameReused() const { return reused; }
 
-		//5.Ⱦ
-		FragmentShader fragmentShader(model.mtl, camera, light, amb_light);
-		fragmentProcess(canvas, fragmentShader, setting);
-	}
+	//side of the drawn frame / side of the canvas
+	float renderScale() const { return scale; }
+
+	//the canvas was drawn on outside the renderer, the next draw must not reuse it
+	void invalidate() { lastFrame.canvas = nullptr; }
 
 	std::wstring debugInfo() {
 		wchar_t str[512];
 		swprintf(str, 512,
 LR"(
 threads: %d
+render scale: %.2f
 )",
-			numThreads);
+			numThreads, scale);
 
 		return std::wstring(str);
 	}
@@ -0,0 +1,150 @@
+#pragma once
+#include "Math.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#endif
+
+//diffuse map with a box filtered mip chain, every level stored in 4x4 texel tiles so a bilinear
+//footprint mostly stays inside one 64 byte line, texels 0x00bbggrr, v = 0 is the bottom row
+class Texture {
+	static constexpr int tileBits = 2;
+	static constexpr int tileSize = 1 << tileBits;
+
+	struct Level {
+		int width, height;
+		int tilesX;
+		std::vector<uint32_t> texel;
+
+		uint32_t at(int x, int y) const {
+			int tile = (y >> tileBits) * tilesX + (x >> tileBits);
+			return texel[tile << 2 * tileBits | (y & (tileSize - 1)) << tileBits | (x & (tileSize - 1))];
+		}
+	};
+	std::vector<Level> level;
+
+	static Level tiled(int width, int height, const std::vector<uint32_t>& linear) {
+		Level l{ width, height, (width + tileSize - 1) >> tileBits };
+		int tilesY = (height + tileSize - 1) >> tileBits;
+		l.texel.resize((size_t)l.tilesX * tilesY << 2 * tileBits);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				int tile = (y >> tileBits) * l.tilesX + (x >> tileBits);
+				l.texel[tile << 2 * tileBits | (y & (tileSize - 1)) << tileBits | (x & (tileSize - 1))] = linear[y * width + x];
+			}
+		}
+		return l;
+	}
+
+	//every level halves the last one, averaging 2x2 texels, odd sides repeat their last row or column
+	void genMips(int width, int height, std::vector<uint32_t> linear) {
+		level.clear();
+		level.push_back(tiled(width, height, linear));
+		while (width > 1 || height > 1) {
+			int w = std::max(width / 2, 1), h = std::max(height / 2, 1);
+			std::vector<uint32_t> next(w * h);
+			for (int y = 0; y < h; y++) {
+				for (int x = 0; x < w; x++) {
+					int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+					int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+					uint32_t c[4] = { linear[y0 * width + x0], linear[y0 * width + x1], linear[y1 * width + x0], linear[y1 * width + x1] };
+					uint32_t out = 0;
+					for (int k = 0; k < 3; k++) {
+						uint32_t sum = 2;
+						for (auto v : c) sum += v >> 8 * k & 0xff;
+						out |= sum / 4 << 8 * k;
+					}
+					next[y * w + x] = out;
+				}
+			}
+			width = w, height = h;
+			linear = std::move(next);
+			level.push_back(tiled(width, height, linear));
+		}
+	}
+
+public:
+
+	int getWidth() const { return level.empty() ? 0 : level[0].width; }
+	int getHeight() const { return level.empty() ? 0 : level[0].height; }
+
+	//binary PPM (P6), 8 bits per channel
+	bool loadPPM(const std::filesystem::path& file) {
+		std::ifstream ifs(file, std::ios::binary);
+		if (!ifs.is_open())return false;
+
+		std::string magic;
+		int width = 0, height = 0, maxVal = 0;
+		auto skip = [&ifs]() {		//whitespace and comments between header fields
+			while (ifs >> std::ws && ifs.peek() == '#') ifs.ignore(1 << 20, '\n');
+			};
+		ifs >> magic;
+		skip(); ifs >> width;
+		skip(); ifs >> height;
+		skip(); ifs >> maxVal;
+		ifs.get();
+		if (magic != "P6" || width <= 0 || height <= 0 || maxVal != 255) return false;
+
+		std::vector<unsigned char> row(3 * width);
+		std::vector<uint32_t> linear((size_t)width * height);
+		for (int y = height - 1; y >= 0; y--) {
+			if (!ifs.read((char*)row.data(), row.size())) return false;
+			for (int x = 0; x < width; x++) {
+				linear[y * width + x] = row[3 * x] | row[3 * x + 1] << 8 | row[3 * x + 2] << 16;
+			}
+		}
+		genMips(width, height, std::move(linear));
+		return true;
+	}
+
+	//the mip level for the uv change between neighbouring pixels along screen x and y
+	float lod(const Math::vec2& ddx, const Math::vec2& ddy) const {
+		float w = (float)getWidth(), h = (float)getHeight();
+		float dx = ddx[0] * ddx[0] * w * w + ddx[1] * ddx[1] * h * h;
+		float dy = ddy[0] * ddy[0] * w * w + ddy[1] * ddy[1] * h * h;
+		return 0.5f * std::log2(std::max(std::max(dx, dy), 1e-20f));
+	}
+
+	//bilinear on the nearest mip level, repeating outside [0, 1]
+	Math::vec3 sample(const Math::vec2& uv, float lod) const {
+		const Level& l = level[std::min(std::max((int)std::floor(lod + 0.5f), 0), (int)level.size() - 1)];
+
+		float fx = (uv[0] - std::floor(uv[0])) * l.width - 0.5f;
+		float fy = (uv[1] - std::floor(uv[1])) * l.height - 0.5f;
+		float x = std::floor(fx), y = std::floor(fy);
+		float wx = fx - x, wy = fy - y;
+		auto wrap = [](int v, int n) { return v < 0 ? v + n : v >= n ? v - n : v; };
+		int x0 = wrap((int)x, l.width), x1 = wrap((int)x + 1, l.width);
+		int y0 = wrap((int)y, l.height), y1 = wrap((int)y + 1, l.height);
+		uint32_t c00 = l.at(x0, y0), c10 = l.at(x1, y0), c01 = l.at(x0, y1), c11 = l.at(x1, y1);
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		//the four texels widened to one float vector each and blended channel-parallel
+		__m128i zero = _mm_setzero_si128();
+		__m128i texel = _mm_set_epi32(c11, c01, c10, c00);
+		__m128i lo = _mm_unpacklo_epi8(texel, zero), hi = _mm_unpackhi_epi8(texel, zero);
+		__m128 t00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), t10 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+		__m128 t01 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), t11 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+		__m128 bottom = _mm_add_ps(t00, _mm_mul_ps(_mm_sub_ps(t10, t00), _mm_set1_ps(wx)));
+		__m128 top = _mm_add_ps(t01, _mm_mul_ps(_mm_sub_ps(t11, t01), _mm_set1_ps(wx)));
+		__m128 c = _mm_mul_ps(_mm_add_ps(bottom, _mm_mul_ps(_mm_sub_ps(top, bottom), _mm_set1_ps(wy))), _mm_set1_ps(1.f / 255));
+		alignas(16) float out[4];
+		_mm_store_ps(out, c);
+		return { out[0], out[1], out[2] };
+#else
+		Math::vec3 ret;
+		for (int k = 0; k < 3; k++) {
+			float bottom = (c00 >> 8 * k & 0xff) + ((float)(c10 >> 8 * k & 0xff) - (c00 >> 8 * k & 0xff)) * wx;
+			float top = (c01 >> 8 * k & 0xff) + ((float)(c11 >> 8 * k & 0xff) - (c01 >> 8 * k & 0xff)) * wx;
+			ret[k] = (bottom + (top - bottom) * wy) / 255;
+		}
+		return ret;
+#endif
+	}
+};
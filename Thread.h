@@ -1,22 +1,97 @@
 #pragma once
 #include <thread>
-#include <functional>
+#include <utility>
+#include <cstddef>
 #include <iostream>
-#include <queue>
+#include <new>
+#include <type_traits>
+#include <vector>
 #include <atomic>
+#include <condition_variable>
 #include <mutex>
 
 class ThreadPool {
+public:
+	//tasks added to a group are waited for by wait(group) instead of barrier,
+	//so a stage can keep running on the pool while another one waits for its own tasks;
+	//they are background work, taken only when no task of the barrier stages is queued
+	using TaskGroup = std::atomic<int>;
+
+private:
+	//a chunk of work f(a) or f(a, b), the callable is copied in place, so a task owns no memory of its own
+	//and a worker calls it through one function pointer
+	class Task {
+		static constexpr int capacity = 64;
+		alignas(std::max_align_t) unsigned char storage[capacity];
+		void (*invoke)(const unsigned char* storage, int a, int b);
+		int a, b;
+
+	public:
+		TaskGroup* group;
+
+		Task() = default;
+		template<class F>
+		Task(const F& f, TaskGroup* group, int a, int b) :a(a), b(b), group(group) {
+			static_assert(sizeof(F) <= capacity && alignof(F) <= alignof(std::max_align_t), "task captures too much");
+			static_assert(std::is_trivially_copyable_v<F> && std::is_trivially_destructible_v<F>, "task must capture references or plain values");
+			::new (storage) F(f);
+			invoke = [](const unsigned char* storage, int a, int b) {
+				const F& f = *std::launder(reinterpret_cast<const F*>(storage));
+				if constexpr (std::is_invocable_v<const F&, int, int>) f(a, b);
+				else f(a);
+				};
+		}
+
+		void operator()() const { invoke(storage, a, b); }
+	};
+
+	//fifo of tasks in a ring over a vector that only grows, once it held the longest backlog queuing allocates nothing
+	class TaskQueue {
+		std::vector<Task> ring;
+		size_t head = 0, count = 0;
+
+	public:
+		TaskQueue(size_t capacity) :ring(capacity) {}
+
+		bool empty() const { return count == 0; }
+		void push(const Task& task) {
+			if (count == ring.size()) {		//full, unroll it into one twice as long
+				std::vector<Task> grown(ring.size() * 2);
+				for (size_t i = 0; i < count; i++) grown[i] = ring[(head + i) % ring.size()];
+				ring.swap(grown);
+				head = 0;
+			}
+			ring[(head + count++) % ring.size()] = task;
+		}
+		Task pop() {
+			Task task = ring[head];
+			head = (head + 1) % ring.size();
+			count--;
+			return task;
+		}
+	};
+
 	int numThreads;
 	std::vector<std::thread> threads;
-	std::queue<std::function<void()>> tasks;
+	TaskQueue tasks{ 256 };
+	TaskQueue background{ 256 };
 	std::mutex mtx;
 	std::mutex idle;
 	std::condition_variable condition;
-	std::atomic<int> numTask = 0;
+	TaskGroup numTask = 0;
 
 	bool shutdown = false;
 
+	template<class F>
+	void push(TaskQueue& queue, TaskGroup& group, const F& f, int a, int b) {
+		mtx.lock();
+		group++;
+		queue.push(Task(f, &group, a, b));
+		mtx.unlock();
+
+		condition.notify_one();
+	}
+
 public:
 
 	ThreadPool(int numThreads) :numThreads(numThreads) {
@@ -25,17 +100,16 @@ public:
 				while (true) {
 					std::unique_lock<std::mutex> lock(mtx);
 
-					condition.wait(lock, [this] {return !tasks.empty() || shutdown; });
+					condition.wait(lock, [this] {return !tasks.empty() || !background.empty() || shutdown; });
 
 					if (shutdown)break;
 
-					auto task(std::move(tasks.front()));
-					tasks.pop();
+					Task task = !tasks.empty() ? tasks.pop() : background.pop();
 					lock.unlock();
 
 					task();
 
-					numTask--;
+					(*task.group)--;
 				}
 				});
 		}
@@ -51,22 +125,23 @@ public:
 		}
 	}
 
-	template<class F, class ...Args>
-	void addTask(F&& f, Args&&... args) {
-		std::function<void()>task = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-
-		mtx.lock();
-		numTask++;
-		tasks.emplace(std::move(task));
-		mtx.unlock();
-
-		condition.notify_one();
+	//f(a) or f(a, b), f is copied and must only capture references or plain values
+	template<class F>
+	void addTask(const F& f, int a, int b = 0) {
+		push(tasks, numTask, f, a, b);
 	}
-	void barrier() {
-		while (numTask > 0) {
+	template<class F>
+	void addGroupTask(TaskGroup& group, const F& f, int a, int b = 0) {
+		push(background, group, f, a, b);
+	}
+	void wait(const TaskGroup& group) {
+		while (group > 0) {
 			idle.lock();
 			idle.unlock();
 		}
 	}
+	void barrier() {
+		wait(numTask);
+	}
 };
 
@@ -0,0 +1,56 @@
+#pragma once
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include "Canvas.h"
+#include <windows.h>
+
+//win32 draw, colorBuf lives in a DIB section blitted to the window
+class Win32Canvas :public Canvas {
+	HDC memDC = nullptr;
+	HDC DC = nullptr;
+	HBITMAP bitMap = nullptr;
+	HGDIOBJ pen = nullptr;
+
+public:
+
+	Win32Canvas(int w, int h, HWND hWnd, Math::vec3 bgColor, Math::vec3 textColor) :
+		Canvas(w, h, bgColor, textColor)
+	{
+		DC = GetDC(hWnd);
+		memDC = CreateCompatibleDC(DC);
+		pen = CreatePen(PS_SOLID, 1, 0);
+		pen = SelectObject(DC, pen);
+		SetBkColor(memDC, RGB(255 * bgColor[0], 255 * bgColor[1], 255 * bgColor[2]));
+		SetTextColor(memDC, RGB(255 * textColor[0], 255 * textColor[1], 255 * textColor[2]));
+
+		BITMAPINFO bi = { { sizeof(BITMAPINFOHEADER), w, h, 1, 32, BI_RGB,
+			(DWORD)w * h * 4, 0, 0, 0, 0 } };
+		bitMap = CreateDIBSection(memDC, &bi, DIB_RGB_COLORS, (void**)&colorBuf, 0, 0);
+
+		if (bitMap)SelectObject(memDC, bitMap);
+		else throw EXCEPTION_BREAKPOINT;
+	}
+
+	~Win32Canvas() {
+		DeleteDC(memDC);
+		DeleteObject(bitMap);
+		pen = SelectObject(DC, pen);
+		DeleteObject(pen);
+		DeleteDC(DC);
+	}
+
+	void drawDebugInfo(const std::wstring& str) override {
+		RECT rect;
+		rect.left = 16;
+		rect.top = 0;
+		rect.right = 400;
+		rect.bottom = 500;
+
+		DrawTextW(memDC, str.c_str(), str.length(), &rect, DT_LEFT | DT_TOP);
+	}
+
+	void update() override {
+		BitBlt(DC, 0, 0, width, height, memDC, 0, 0, SRCCOPY);
+	}
+};
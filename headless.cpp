@@ -0,0 +1,110 @@
+#include "Renderer.h"
+#include <cstdio>
+#include <cstring>
+
+//usage: headless [options] [model.obj] [frames] [output.ppm|output.raw] [width] [height] [camera x y z]
+//options: --depth --framework --no-cull --vis --msaa --prepass --instances n (n copies of the model on a grid) --lod pixels (0 draws the full mesh)
+//         --budget ms (dynamic resolution frame budget) --pipelined (shade each frame while setting up the next)
+//         --texture file.ppm (diffuse map of every instance, instead of the obj's own)
+//         --lights n (n more point lights of radius 1.5 scattered around the model)
+int main(int argc, char** argv) {
+	Setting setting;
+
+	int instances = 1;
+	int pointLights = 0;
+	const char* texturePath = nullptr;
+	std::vector<const char*> arg;
+	for (int i = 1; i < argc; i++) {
+		if (!std::strcmp(argv[i], "--depth")) setting.mod = Setting::Mod::zColoring;
+		else if (!std::strcmp(argv[i], "--framework")) setting.mod = Setting::Mod::framework;
+		else if (!std::strcmp(argv[i], "--no-cull")) setting.backfaceCulling = false;
+		else if (!std::strcmp(argv[i], "--vis")) setting.visibilityBuffer = true;
+		else if (!std::strcmp(argv[i], "--msaa")) setting.msaa = true;
+		else if (!std::strcmp(argv[i], "--prepass")) setting.zPrepass = true;
+		else if (!std::strcmp(argv[i], "--instances") && i + 1 < argc) instances = std::max(std::atoi(argv[++i]), 1);
+		else if (!std::strcmp(argv[i], "--lod") && i + 1 < argc) setting.lodError = std::atof(argv[++i]);
+		else if (!std::strcmp(argv[i], "--budget") && i + 1 < argc) setting.frameBudget = std::atof(argv[++i]);
+		else if (!std::strcmp(argv[i], "--pipelined")) setting.pipelined = true;
+		else if (!std::strcmp(argv[i], "--texture") && i + 1 < argc) texturePath = argv[++i];
+		else if (!std::strcmp(argv[i], "--lights") && i + 1 < argc) pointLights = std::max(std::atoi(argv[++i]), 0);
+		else arg.push_back(argv[i]);
+	}
+	int num = arg.size();
+
+	std::filesystem::path modelPath = num > 0 ? arg[0] : "models/sphere.obj";
+	int frames = num > 1 ? std::atoi(arg[1]) : 1;
+	std::string output = num > 2 ? arg[2] : "frame.ppm";
+	int frameWidth = num > 3 ? std::atoi(arg[3]) : 100 * 16;
+	int frameHeight = num > 4 ? std::atoi(arg[4]) : 100 * 9;
+
+	Math::vec3 eye = { 0,0,2 };
+	for (int i = 0; i < 3 && 5 + i < num; i++) eye[i] = std::atof(arg[5 + i]);
+
+	Camera camera(Object(eye, { 0,0,-1 }, { 0,1,0 }, 0, 0.01, 0.02));
+
+	Model model(Object({ 0,0,0 }, { 0,0,-1 }, { 0,1,0 }, Actions::turnLeft, 0, 0.0015),
+		Matirial({ 0.005, 0.005, 0.005 }, { 0.8, 0.86, 0.88 }, { 0.2, 0.2, 0.2 }));
+	if (!model.loadOBJ(modelPath.parent_path().wstring(), modelPath.filename().wstring())) {
+		std::fprintf(stderr, "failed to load %s\n", modelPath.string().c_str());
+		return 1;
+	}
+
+	std::shared_ptr<Texture> texture;
+	if (texturePath) {
+		texture = std::make_shared<Texture>();
+		if (!texture->loadPPM(texturePath)) {
+			std::fprintf(stderr, "failed to load %s\n", texturePath);
+			return 1;
+		}
+	}
+
+	//copies on a grid spreading along x and going away from the camera, all sharing one mesh
+	Scene scene;
+	int side = (int)std::ceil(std::sqrt((float)instances));
+	for (int i = 0; i < instances; i++) {
+		float x = (i % side - (side - 1) / 2) * 3.f, z = -(i / side) * 3.f;
+		scene.model.push_back(model.instance(Object({ x, 0, z }, { 0,0,-1 }, { 0,1,0 }, Actions::turnLeft, 0, 0.0015),
+			Matirial({ 0.005, 0.005, 0.005 }, { 0.8, 0.86, 0.88 }, { 0.2, 0.2, 0.2 }, texture)));
+	}
+
+	std::vector<Light> light;
+	light.push_back({ {0,30,30},{500,500,500} });
+	light.push_back({ {30,30,30},{1000,1000,1000} });
+
+	//the same pseudo random spots and colors on every run
+	uint32_t seed = 1;
+	auto random = [&seed](float lo, float hi) {
+		seed = seed * 1664525u + 1013904223u;
+		return lo + (hi - lo) * (seed >> 8) / 16777216.f;
+		};
+	for (int i = 0; i < pointLights; i++) {
+		Math::vec3 pos = { random(-3, 3), random(-0.5, 2), random(-2, 2) };
+		Math::vec3 color = { random(0, 1), random(0, 1), random(0, 1) };
+		light.push_back({ pos, color * 0.5f, 1.5f });
+	}
+
+	Math::vec3 amb_light{ 10,10,10 };
+
+	OffscreenCanvas canvas(frameWidth, frameHeight, { 0.08,0,0.07 });
+
+	Renderer renderer;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < frames; i++) {
+		camera.updateAtiitude();
+		scene.updateAtiitude();
+
+		renderer.draw(canvas, camera, setting, scene, light, amb_light);
+	}
+	renderer.finish();		//pipelined the last frame is still waiting
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::printf("%d frames, %.3f ms/frame\n", frames, frames > 0 ? ms / frames : 0.0);
+	if (setting.frameBudget > 0) std::printf("render scale %.2f\n", renderer.renderScale());
+
+	bool raw = output.size() >= 4 && output.compare(output.size() - 4, 4, ".raw") == 0;
+	if (!(raw ? canvas.saveRaw(output) : canvas.savePPM(output))) {
+		std::fprintf(stderr, "failed to write %s\n", output.c_str());
+		return 1;
+	}
+	return 0;
+}
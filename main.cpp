@@ -1,8 +1,10 @@
-﻿#include <windows.h>
+﻿#define NOMINMAX
+#include <windows.h>
 #include <stdlib.h>
 #include <malloc.h>
 #include <memory.h>
 #include "Renderer.h"
+#include "Win32Canvas.h"
 
 const int frameWidth = 100 * 16;
 const int frameHeight = 100 * 9;
@@ -60,6 +62,9 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 		Matirial({ 0.005, 0.005, 0.005 }, { 0.8, 0.86, 0.88 }, { 0.2, 0.2, 0.2 }));
 	model.loadOBJ(L"models", L"dragon.obj");
 
+	Scene scene;
+	scene.model.push_back(model);
+
 	std::vector<Light> light;
 	light.push_back({ {0,30,30},{500,500,500} });
 	light.push_back({ {30,30,30},{1000,1000,1000} });
@@ -68,7 +73,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
 	Setting setting;
 
-	Canvas canvas(frameWidth, frameHeight, hWndMain, { 0.08,0,0.07 }, { 0.6,0.6,0.6 });
+	Win32Canvas canvas(frameWidth, frameHeight, hWndMain, { 0.08,0,0.07 }, { 0.6,0.6,0.6 });
 
 	Renderer renderer;
 
@@ -100,16 +105,22 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 				else if (msg.wParam == '2' && !keyup) setting.mod = Setting::Mod::zColoring;
 				else if (msg.wParam == '3' && !keyup) setting.mod = Setting::Mod::framework;
 				else if (msg.wParam == 'B' && !keyup) setting.backfaceCulling = !setting.backfaceCulling;
+				else if (msg.wParam == 'V' && !keyup) setting.visibilityBuffer = !setting.visibilityBuffer;
+				else if (msg.wParam == 'M' && !keyup) setting.msaa = !setting.msaa;
+				else if (msg.wParam == 'Z' && !keyup) setting.zPrepass = !setting.zPrepass;
+				else if (msg.wParam == 'L' && !keyup) setting.lodError = setting.lodError > 0 ? 0.f : 1.f;
+				else if (msg.wParam == 'R' && !keyup) setting.frameBudget = setting.frameBudget > 0 ? 0.f : 1000.f / 30;
+				else if (msg.wParam == 'P' && !keyup) setting.pipelined = !setting.pipelined;
 				else if (msg.wParam == 'F' && !keyup) showInfo = !showInfo;
 			}
 		}
 		
 		//1.更新相机和物体姿态
 		camera.updateAtiitude();
-		model.updateAtiitude();
+		scene.updateAtiitude();
 		
-		//2.绘制到缓冲
-		renderer.draw(canvas, camera, setting, model, light, amb_light);
+		//2.绘制到缓冲，没有变化时沿用上一帧
+		renderer.draw(canvas, camera, setting, scene, light, amb_light);
 
 		//3.计算帧率
 		frameCnt++;
@@ -128,12 +139,16 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 				renderer.debugInfo() +
 				setting.debugInfo() +
 				camera.debugInfo() +
-				model.debugInfo();
+				scene.debugInfo();
+			canvas.drawDebugInfo(debug);
+			renderer.invalidate();		//the text is drawn into the frame
 		}
-		canvas.drawDebugInfo(debug);
 
 		//5.更新缓冲
 		canvas.update();
+
+		//6.画面不变时等下一条消息，不再空转
+		if (renderer.frameReused() && !showInfo) MsgWaitForMultipleObjectsEx(0, nullptr, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
 	}
 
 	return (int)msg.wParam;